@@ -1,8 +1,48 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-#define INITIAL_VOCAB_SIZE 500
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define INITIAL_VOCAB_SIZE 256
+
+#define ARENA_FIRST_BLOCK_SIZE (16 * 1024)
+#define ARENA_MAX_BLOCK_SIZE (64 * 1024 * 1024)
+#define ARENA_ALIGNMENT 16
+
+#define BYTE_PAIR_TABLE_SIZE (256 * 256)
+
+#define PERFECT_HASH_BUCKET_SIZE 4      // Average merges per bucket
+#define PERFECT_HASH_MAX_SEED (1 << 20) // Seeds tried per bucket before enlarging the table
+
+#define RADIX_BITS 11 // Bits sorted per pass of the sort-based stats engine
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define PARALLEL_SORT_MIN_KEYS (1 << 20) // Below this, thread start-up outweighs the parallel passes
+#define MAX_SORT_WINDOW (1 << 30)         // Pairs sorted at once, so positions fit in 32 bits
+#define SKETCH_DEPTH 4                         // Counter rows of the count-min sketch
+#define DEFAULT_SKETCH_BYTES (16 * 1024 * 1024) // Memory for the sketch engine's counters
+
+#define DEFAULT_SHARD_BYTES (64 * 1024 * 1024) // Corpus bytes per shard in out-of-core training
+#define MAX_SHARD_BYTES (256 * 1024 * 1024)
+#define DEFAULT_SAMPLE_CHUNK_BYTES (64 * 1024) // Contiguous corpus bytes per chunk in sampled training
+
+#define MODEL_MAGIC "MINBPE\0\0"
+#define MODEL_VERSION 5
+#define MODEL_BYTE_ORDER 0x01020304u
+#define MODEL_ALIGNMENT 64
+
+#define MINBPE_VERSION_LINE "minbpe v1"
 
 typedef struct
 {
@@ -10,323 +50,5751 @@ typedef struct
     int second;
 } Pair;
 
+/*
+ * A pair packed into one 64-bit key, first << 32 | second. Pair statistics, merges and
+ * rank tables store keys so that equality is a single compare and hashing mixes one word;
+ * Pair remains the type of the public API.
+ */
+typedef uint64_t PairKey;
+
+#define EMPTY_PAIR_KEY UINT64_MAX // Packs {-1, -1}; marks unused rank table slots
+
+/*
+ * Categories that memory accounting is broken down by. MEMORY_TOTAL is not a category of
+ * its own: it tracks every byte actually obtained from allocators, including arena block
+ * slack and allocation headers that the categories do not attribute.
+ */
+typedef enum
+{
+    MEMORY_IDS,         // Token id sequences: training buffers, encode and merge results
+    MEMORY_PAIR_COUNTS, // Pair statistics gathered during training
+    MEMORY_VOCAB,       // Vocabulary bytes, offsets and byte ids
+    MEMORY_MERGES,      // Learned merges and the rank table built from them
+    MEMORY_OTHER,       // Loader buffers, batch bookkeeping and tokenizer structs
+    MEMORY_TOTAL,
+    MEMORY_SUBSYSTEMS
+} MemorySubsystem;
+
+typedef struct
+{
+    size_t current; // Bytes in use right now
+    size_t peak;    // Highest value `current` reached since the last reset
+} MemoryUsage;
+
+/*
+ * Allocation callbacks. `release` receives the size that was passed to `allocate`, so
+ * simple pool or accounting allocators need no per-block headers.
+ */
+typedef struct
+{
+    void *(*allocate)(void *context, size_t size);
+    void (*release)(void *context, void *block, size_t size);
+    void *context;
+} Allocator;
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next; // Previously filled block
+    size_t size;             // Usable bytes following the header
+    size_t used;
+} ArenaBlock;
+
+/*
+ * Bump allocator carving many small arrays out of a few large blocks obtained from an
+ * Allocator. Blocks double in size as the arena fills, and everything is released at
+ * once by arena_release.
+ */
+typedef struct
+{
+    Allocator allocator;
+    ArenaBlock *blocks; // Block currently being filled, or NULL
+    size_t next_block_size;
+    size_t carved[MEMORY_SUBSYSTEMS]; // Bytes handed out per subsystem, for accounting
+} Arena;
+
 typedef struct
 {
-    Pair *pairs;
-    int *counts;
+    PairKey *keys;
+    int64_t *counts; // Occurrences of each pair
     int size;
     int capacity;
+    Arena *arena; // Storage for keys and counts, or NULL to use tracked heap allocations
+    MemorySubsystem subsystem; // Accounting category of the storage
+    int *index;         // Open-addressing hash of entry + 1 (0 = empty) used by add_pair_count
+    int index_capacity; // Power of two, at least twice `capacity`
+    int *byte_pairs;    // Optional dense entry + 1 table for byte pairs, bypassing `index`
 } PairCounts;
 
+/*
+ * What training knows about pairs that can no longer reach TrainOptions.min_frequency.
+ * Counts never grow: a merge only removes occurrences of the pairs around it, and every
+ * pair it creates contains the new token. So a pair of tokens older than `first_new_id`
+ * that the previous pass no longer holds is below the minimum for good, and counting can
+ * skip it instead of tabling it only to prune it again.
+ */
+typedef struct
+{
+    PairCounts *previous; // The previous pass's pruned pairs, or NULL to count every pair
+    int first_new_id;     // Tokens from this id on were created after the previous pass
+    int64_t min_count;    // Counts below this are dead when the ids counted are the whole corpus, else 0
+} LivePairs;
+
+/*
+ * The merges in the order they were learned: each pair and the token id it merges into.
+ */
+typedef struct
+{
+    PairKey *keys;
+    int32_t *ids;
+    int size;
+    int capacity;
+    Arena *arena; // Storage for keys and ids, or NULL for mapped or embedded lists
+} MergeList;
+
+typedef struct
+{
+    PairKey key; // EMPTY_PAIR_KEY in unused slots
+    int idx;     // Token the pair merges into; lower ids were merged earlier, so this is also the rank
+    int reserved;
+} RankEntry;
+
+/*
+ * Minimal perfect hash over a frozen merge list (hash and displace): a pair's bucket
+ * selects a seed, and the pair hashed with that seed names the single slot it can be in.
+ */
+typedef struct
+{
+    uint32_t *seeds;  // Displacement seed per bucket
+    RankEntry *slots; // One merge per slot; unused slots hold EMPTY_PAIR_KEY
+    int num_buckets;
+    int num_slots;
+} PerfectHash;
+
 typedef struct
 {
-    unsigned char **vocab; // Dynamic array of tokens
+    RankEntry *entries; // Open addressing, empty slots hold EMPTY_PAIR_KEY
+    int capacity;       // Always a power of two
+    int *byte_pairs;    // Dense BYTE_PAIR_TABLE_SIZE ranks of byte pairs (-1 if unmerged), or NULL
+    PerfectHash perfect; // Built by freeze_merges; slots is NULL until then
+    // Arena storage carved by earlier builds, reused by rebuilds while it is large enough
+    int allocated_entries;  // Room behind `entries`; 0 if the tables are mapped or not built yet
+    uint32_t *seed_storage;
+    RankEntry *slot_storage;
+    int allocated_seeds;
+    int allocated_slots;
+} RankTable;
+
+typedef struct
+{
+    unsigned char *vocab; // Bytes of every token stored back to back
+    int *vocab_offsets;   // Token i spans vocab[vocab_offsets[i]] .. vocab[vocab_offsets[i + 1] - 1]
     int vocab_size;
-    PairCounts merges; // To store merges as a dictionary of pairs to int
+    int vocab_capacity;       // Tokens that fit in vocab_offsets before it must grow
+    int vocab_bytes_capacity; // Bytes that fit in vocab before it must grow
+    int *byte_ids;     // Token id of each of the 256 byte values; identity unless imported
+    MergeList merges;  // Learned merges in order, pair -> merged id
+    RankTable ranks;   // Pair -> merged id lookup used by encode
+    void *mapping;     // Model file mapping backing all tables, or NULL if the tables are heap-owned
+    size_t mapping_size;
+    int embedded;      // Tables and struct are static data generated by write_c_source
+    Arena arena;       // Owns the struct's tables unless mapped or embedded
 } BasicTokenizer;
 
-void init_pair_counts(PairCounts *counts)
+/*
+ * Read-only lookup tables compiled from a BasicTokenizer by compile_tokenizer. Nothing in
+ * it changes after compilation, so one instance can be shared by any number of threads.
+ */
+typedef struct
 {
-    counts->pairs = NULL;
-    counts->counts = NULL;
-    counts->size = 0;
-    counts->capacity = 0;
+    const unsigned char *vocab;
+    const int *vocab_offsets;
+    int vocab_size;
+    int byte_ids[256];
+    RankTable ranks; // Dense byte-pair table plus the perfect hash (or the hash table if unfrozen)
+    size_t size;     // Bytes in the single allocation holding the struct and its tables
+} CompiledTokenizer;
+
+typedef enum
+{
+    STATS_ENGINE_HASH, // Count pairs in a hash table (dense table for byte pairs)
+    STATS_ENGINE_SORT, // Radix-sort packed pair keys and run-length encode them
+    STATS_ENGINE_SKETCH, // Count only pairs a count-min sketch shows to be frequent
+} StatsEngine;
+
+/*
+ * Tuning knobs for train_with_options. Start from default_train_options() so that fields
+ * added later keep their defaults.
+ */
+typedef struct
+{
+    StatsEngine stats_engine;
+    int num_threads; // Threads used by the sort engine's radix passes
+    int verbose;
+    size_t shard_bytes;       // train_out_of_core: corpus bytes held in memory at a time
+    const char *scratch_path; // train_out_of_core: file for the token shards, or NULL for tmpfile()
+    const char *checkpoint_path; // Model file rewritten every checkpoint_interval merges, or NULL
+    int checkpoint_interval;
+    int resume; // Continue from checkpoint_path if it exists instead of starting over
+    int merges_per_pass; // Above 1, approximate BPE: merge this many disjoint pairs per pass
+    double sample_rate;        // Below 1, learn merges from about this fraction of the corpus
+    size_t sample_chunk_bytes; // Size of the chunks the sample is made of
+    uint64_t sample_seed;      // Picks the chunks; the same seed gives the same sample
+    int refine_merges;         // With sampling: learn this many final merges on the full corpus
+    size_t sketch_bytes;       // Sketch engine: memory for the count-min sketch
+    int64_t sketch_min_count;  // Sketch engine: lowest count tabled while the top pair reaches it
+    int64_t min_frequency;     // Stop once no pair occurs this often; rarer pairs are pruned
+    int num_workers;           // train_bytes: worker processes counting and merging the ids
+} TrainOptions;
+
+/*
+ * On-disk layout of a model file. The header is followed by the sections it points to,
+ * each aligned to MODEL_ALIGNMENT bytes. Every section is stored exactly as the
+ * corresponding in-memory array, in native byte order, so a mapped file can be used in
+ * place without parsing.
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // MODEL_BYTE_ORDER as written by the producing machine
+    int32_t vocab_size;
+    int32_t num_merges;
+    int32_t rank_capacity;
+    int32_t vocab_bytes;
+    uint64_t merge_pairs_offset; // PairKey[num_merges]
+    uint64_t merge_ids_offset;   // int32[num_merges]
+    uint64_t vocab_offsets_offset; // int32[vocab_size + 1]
+    uint64_t vocab_offset;       // uint8[vocab_bytes]
+    uint64_t ranks_offset;       // RankEntry[rank_capacity]
+    uint64_t byte_ids_offset;    // int32[256]
+    uint64_t byte_pair_ranks_offset; // int32[BYTE_PAIR_TABLE_SIZE]
+    int32_t perfect_buckets;
+    int32_t perfect_slots;
+    uint64_t perfect_seeds_offset; // uint32[perfect_buckets]
+    uint64_t perfect_slots_offset; // RankEntry[perfect_slots]
+    uint64_t file_size;
+} ModelHeader;
+
+_Static_assert(sizeof(int) == sizeof(int32_t), "model files store int arrays as int32");
+
+/*
+ * A tokenizer generated by `basic emit-c` can be compiled in by naming its file, e.g.
+ * -DEMBEDDED_MODEL='"tokenizer_model.h"'. It only needs the types above.
+ */
+#ifdef EMBEDDED_MODEL
+#include EMBEDDED_MODEL
+#endif
+
+typedef struct
+{
+    BasicTokenizer *tokenizer;
+    unsigned char carry[4]; // Bytes of a UTF-8 sequence that is not complete yet
+    size_t carry_length;
+} StreamDecoder;
+
+typedef struct
+{
+    BasicTokenizer *tokenizer;
+    int **ids;
+    size_t *lengths;
+    size_t *offsets;
+    unsigned char *out;
+    int begin; // First sequence handled by this worker
+    int end;   // One past the last sequence handled by this worker
+    int failed;
+} DecodeBatchTask;
+
+/*
+ * Working buffers of the sort-based stats engine, sized for the training sequence once
+ * and reused on every pass.
+ */
+typedef struct
+{
+    PairKey *keys;            // Pair keys of the sequence, sorted in place
+    PairKey *keys_swap;       // Scatter target of each radix pass
+    uint32_t *positions;      // Sequence position of each key, carried through the sort
+    uint32_t *positions_swap; // Scatter target for positions; holds run lengths afterwards
+    int *run_at;              // Start of the run first seen at each position, or -1
+} SortStatsBuffers;
+
+/*
+ * Count-min sketch of the pair counts of one pass, used by the sketch stats engine to find
+ * the frequent pairs before counting them exactly.
+ */
+typedef struct
+{
+    uint32_t *cells;   // SKETCH_DEPTH rows of `width` counters, interleaved by block
+    int width;         // Counters per row, a power of two
+    int64_t min_count; // Lowest threshold used while some pair reaches it
+    int64_t floor;     // Pairs below this are never tabled (TrainOptions.min_frequency)
+    int64_t last_max;  // Highest count of the previous pass; half of it is the next threshold
+} CountMinSketch;
+
+typedef struct
+{
+    SortStatsBuffers *buffers;
+    int begin; // First key handled by this worker
+    int end;   // One past the last key handled by this worker
+    int id_bits;    // Significant bits per id in the keys being sorted
+    int shift;      // Position of this pass's digit in the compacted key
+    int *histogram; // RADIX_BUCKETS digit counts, then this worker's scatter offsets
+} RadixSortTask;
+
+/*
+ * A pending merge in apply_merges_linked_wide, for sequences whose positions do not fit
+ * the 32 bits merge_candidate packs them into.
+ */
+typedef struct
+{
+    int idx;
+    size_t position;
+} WideMergeCandidate;
+
+/*
+ * A pair in line for a batch of merges: its count and its index in the stats, which
+ * breaks ties in favour of the pair seen first, as argmax_counts does.
+ */
+typedef struct
+{
+    int64_t count;
+    int index;
+} RankedPair;
+
+/*
+ * The merges chosen in one pass over the training data. With more than one, no two share
+ * a token, so they can all be applied in a single pass over the ids.
+ */
+typedef struct
+{
+    Pair *pairs;             // Chosen pairs, most frequent first
+    int *merged;             // Id of the token each pair merges into
+    int size;
+    int *batch_of;           // Per token id: the chosen pair it starts, or -1
+    unsigned char *in_batch; // Per token id: non-zero if a chosen pair uses it
+    RankedPair *order;       // The most frequent candidates, sorted by count
+    int order_capacity;
+} MergeBatch;
+
+/*
+ * How far one merge list strays from another, as measured by compare_merges.
+ */
+typedef struct
+{
+    int common_prefix;      // Leading merges identical in both lists
+    int shared_tokens;      // Merged tokens of the first list that the second also learned
+    int compared_tokens;    // Merged tokens in the first list
+    double mean_rank_shift; // Mean distance between the merge positions of shared tokens
+} MergeDivergence;
+
+/*
+ * What a training worker sends the coordinator after each count: the pair counts of its
+ * segment of the ids, then how the segment begins and ends, which is all the coordinator
+ * needs to count and merge the pairs that straddle two segments.
+ */
+typedef struct
+{
+    int num_pairs;     // Followed by num_pairs packed pair keys, then num_pairs counts
+    int first;         // First id of the segment, or -1 if it is empty
+    int last;          // Last id of the segment, or -1 if it is empty
+    int64_t length;    // Ids in the segment
+    int64_t first_run; // Ids at the start equal to `first`
+    int64_t last_run;  // Ids at the end equal to `last`
+} WorkerReport;
+
+/*
+ * What the coordinator sends a training worker after each choice of merges.
+ */
+typedef struct
+{
+    int size;       // Followed by `size` pairs, then the ids they merge into; 0 ends training
+    int join_first; // The segment's first id merges into the previous segment's last id
+    int join_last;  // Id that replaces the segment's last id, or -1
+} WorkerCommand;
+
+/*
+ * The coordinator's end of one training worker process.
+ */
+typedef struct
+{
+    pid_t pid;
+    FILE *commands; // Pipe to the worker
+    FILE *reports;  // Pipe from the worker
+    WorkerReport report;
+    WorkerCommand command;
+} TrainingWorker;
+
+void *heap_allocate(void *context, size_t size)
+{
+    (void)context;
+    return malloc(size);
+}
+
+void heap_release(void *context, void *block, size_t size)
+{
+    (void)context;
+    (void)size;
+    free(block);
 }
 
 /**
- * Adds a pair count to the PairCounts structure or increments the count
- * if the pair already exists.
+ * Returns an Allocator backed by malloc and free.
+ */
+Allocator heap_allocator()
+{
+    Allocator allocator = {heap_allocate, heap_release, NULL};
+    return allocator;
+}
+
+static Allocator current_allocator = {heap_allocate, heap_release, NULL};
+static atomic_size_t memory_current[MEMORY_SUBSYSTEMS];
+static atomic_size_t memory_peak[MEMORY_SUBSYSTEMS];
+
+/**
+ * Sets the allocator used for every allocation basic.c makes from now on, including the
+ * arenas of tokenizers created afterwards. Memory is always returned to the allocator it
+ * came from, so the allocator can be changed at any time, but the previous one must stay
+ * usable until everything allocated from it has been released.
  *
- * This function searches for the given pair in the PairCounts structure. If found,
- * it increments the existing count by the specified initial_count. If the pair
- * is not found, the pair and the initial_count are added to the structure.
- * If necessary, the function reallocates memory to expand the PairCounts arrays
- * when the current capacity is reached.
+ * @param allocator The allocation callbacks to use.
  *
- * @param counts A pointer to the PairCounts structure where the pair and count are to be added.
- * @param pair The pair of integers (defined in a Pair structure) to be added or updated.
- * @param initial_count The count to be added for the pair. If the pair exists, this value
- *                      is added to the existing count.
+ * Example usage:
+ * Allocator allocator = {my_alloc, my_free, my_context};
+ * set_allocator(allocator);
  */
-void add_pair_count(PairCounts *counts, Pair pair, int initial_count)
+void set_allocator(Allocator allocator)
 {
-    for (int i = 0; i < counts->size; i++)
+    current_allocator = allocator;
+}
+
+/**
+ * Returns the allocator currently used for new allocations.
+ */
+Allocator get_allocator()
+{
+    return current_allocator;
+}
+
+/**
+ * Adds `delta` bytes (which may be negative) to a subsystem's usage and raises its peak
+ * when needed. Safe to call from any thread.
+ */
+void account_memory(MemorySubsystem subsystem, long long delta)
+{
+    size_t now = atomic_fetch_add(&memory_current[subsystem], (size_t)delta) + (size_t)delta;
+    size_t peak = atomic_load(&memory_peak[subsystem]);
+    while (delta > 0 && now > peak && !atomic_compare_exchange_weak(&memory_peak[subsystem], &peak, now))
     {
-        if (counts->pairs[i].first == pair.first && counts->pairs[i].second == pair.second)
-        {
-            counts->counts[i] += initial_count;
-            return;
-        }
     }
-    if (counts->size == counts->capacity)
+}
+
+/**
+ * Reports how much memory a subsystem uses right now and at its peak. Counters are
+ * process-wide and updated atomically, so this can be polled at any time, including from
+ * another thread while train() is running, to size jobs or to spot a leak as a current
+ * value that keeps climbing.
+ *
+ * @param subsystem The category to query, or MEMORY_TOTAL for all allocator traffic.
+ * @return The current and peak number of bytes.
+ *
+ * Example usage:
+ * MemoryUsage ids = memory_usage(MEMORY_IDS);
+ * printf("ids: %zu bytes now, %zu at peak\n", ids.current, ids.peak);
+ */
+MemoryUsage memory_usage(MemorySubsystem subsystem)
+{
+    MemoryUsage usage;
+    usage.current = atomic_load(&memory_current[subsystem]);
+    usage.peak = atomic_load(&memory_peak[subsystem]);
+    return usage;
+}
+
+/**
+ * Resets every peak to the corresponding current value, so that the next measurement
+ * reports the high-water mark of what runs afterwards.
+ */
+void reset_memory_peaks()
+{
+    for (int s = 0; s < MEMORY_SUBSYSTEMS; s++)
     {
-        counts->capacity = counts->capacity == 0 ? 4 : counts->capacity * 2;
-        counts->pairs = realloc(counts->pairs, counts->capacity * sizeof(Pair));
-        counts->counts = realloc(counts->counts, counts->capacity * sizeof(int));
+        atomic_store(&memory_peak[s], atomic_load(&memory_current[s]));
     }
-    counts->pairs[counts->size] = pair;
-    counts->counts[counts->size] = initial_count;
-    counts->size++;
 }
 
 /**
- * Generates a PairCounts structure containing counts of consecutive integer pairs
- * in the provided array. This function processes an array of integers and counts
- * how many times each consecutive pair (n, n+1) appears.
+ * Prints the current and peak usage of every subsystem.
+ */
+void print_memory_usage(FILE *file)
+{
+    static const char *names[MEMORY_SUBSYSTEMS] = {"ids", "pair counts", "vocab", "merges", "other", "total"};
+    for (int s = 0; s < MEMORY_SUBSYSTEMS; s++)
+    {
+        MemoryUsage usage = memory_usage(s);
+        fprintf(file, "%-12s %12zu bytes current %12zu bytes peak\n", names[s], usage.current, usage.peak);
+    }
+}
+
+/*
+ * Header placed in front of every tracked heap allocation. It remembers where the block
+ * came from so basic_free needs neither a size nor the allocator that was current.
+ */
+typedef struct
+{
+    Allocator allocator;
+    size_t size;
+    MemorySubsystem subsystem;
+} TrackedHeader;
+
+#define TRACKED_HEADER_SIZE ((sizeof(TrackedHeader) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+/**
+ * Allocates `size` bytes from the current allocator and accounts them to `subsystem`.
+ * Memory from basic_alloc must be released with basic_free rather than free. The arrays
+ * that encode, encode_bytes, compiled_encode and merge hand to their callers are plain
+ * malloc memory instead, released with free as they always were, and are not accounted.
  *
- * The function initializes a PairCounts structure, iterates through the array of
- * integers, and for each consecutive pair of elements, it updates or adds a new
- * entry in the PairCounts structure using the add_pair_count function.
+ * @param subsystem The accounting category of the allocation.
+ * @param size The number of bytes needed.
+ * @return Pointer to the allocated memory, or NULL if the allocator fails.
+ */
+void *basic_alloc(MemorySubsystem subsystem, size_t size)
+{
+    Allocator allocator = current_allocator;
+    TrackedHeader *header = allocator.allocate(allocator.context, TRACKED_HEADER_SIZE + size);
+    if (header == NULL)
+    {
+        return NULL;
+    }
+    header->allocator = allocator;
+    header->size = size;
+    header->subsystem = subsystem;
+    account_memory(subsystem, size);
+    account_memory(MEMORY_TOTAL, TRACKED_HEADER_SIZE + size);
+    return (unsigned char *)header + TRACKED_HEADER_SIZE;
+}
+
+/**
+ * Releases memory obtained from basic_alloc or basic_realloc. Passing NULL does nothing.
+ */
+void basic_free(void *data)
+{
+    if (data == NULL)
+    {
+        return;
+    }
+    TrackedHeader *header = (TrackedHeader *)((unsigned char *)data - TRACKED_HEADER_SIZE);
+    account_memory(header->subsystem, -(long long)header->size);
+    account_memory(MEMORY_TOTAL, -(long long)(TRACKED_HEADER_SIZE + header->size));
+    header->allocator.release(header->allocator.context, header, TRACKED_HEADER_SIZE + header->size);
+}
+
+/**
+ * Resizes memory obtained from basic_alloc, like realloc. A NULL `data` allocates fresh
+ * memory accounted to `subsystem`; otherwise the block keeps its original subsystem.
+ */
+void *basic_realloc(MemorySubsystem subsystem, void *data, size_t size)
+{
+    if (data != NULL)
+    {
+        TrackedHeader *header = (TrackedHeader *)((unsigned char *)data - TRACKED_HEADER_SIZE);
+        subsystem = header->subsystem;
+    }
+    void *resized = basic_alloc(subsystem, size);
+    if (resized != NULL && data != NULL)
+    {
+        TrackedHeader *header = (TrackedHeader *)((unsigned char *)data - TRACKED_HEADER_SIZE);
+        memcpy(resized, data, header->size < size ? header->size : size);
+        basic_free(data);
+    }
+    return resized;
+}
+
+void init_arena(Arena *arena, Allocator allocator)
+{
+    arena->allocator = allocator;
+    arena->blocks = NULL;
+    arena->next_block_size = ARENA_FIRST_BLOCK_SIZE;
+    memset(arena->carved, 0, sizeof(arena->carved));
+}
+
+/**
+ * Carves `size` bytes out of an arena. When the current block is full, a new block is
+ * requested from the arena's allocator, at least double the size of the previous one
+ * (up to ARENA_MAX_BLOCK_SIZE, or larger if a single request needs it), so the number of
+ * allocator calls grows only logarithmically with the memory in use.
  *
- * @param ids An array of integers for which consecutive pairs are to be counted.
- * @param length The number of elements in the ids array.
- * @return A PairCounts structure populated with pairs and their corresponding counts.
+ * @param arena Pointer to the Arena to allocate from.
+ * @param subsystem The accounting category of the carved bytes.
+ * @param size The number of bytes needed.
+ * @return Pointer to ARENA_ALIGNMENT-aligned storage, or NULL if the allocator fails.
+ */
+void *arena_alloc(Arena *arena, MemorySubsystem subsystem, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->size - block->used < size)
+    {
+        size_t block_size = arena->next_block_size > size ? arena->next_block_size : size;
+        block = arena->allocator.allocate(arena->allocator.context, sizeof(ArenaBlock) + ARENA_ALIGNMENT + block_size);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->size = block_size;
+        block->used = 0;
+        arena->blocks = block;
+        account_memory(MEMORY_TOTAL, sizeof(ArenaBlock) + ARENA_ALIGNMENT + block_size);
+        if (arena->next_block_size < ARENA_MAX_BLOCK_SIZE)
+        {
+            arena->next_block_size *= 2;
+        }
+    }
+    unsigned char *data = (unsigned char *)(block + 1);
+    data += (ARENA_ALIGNMENT - (uintptr_t)data % ARENA_ALIGNMENT) % ARENA_ALIGNMENT;
+    void *result = data + block->used;
+    block->used += size;
+    arena->carved[subsystem] += size;
+    account_memory(subsystem, size);
+    return result;
+}
+
+/**
+ * Resizes an array previously carved from an arena. If it was the most recent allocation
+ * and the current block has room, it grows in place; otherwise a new region is carved and
+ * the old contents copied, leaving the old region unused until the arena is released.
+ * Callers grow geometrically, which bounds that waste by the final size.
  *
- * Example usage:
- * int ids[] = {1, 2, 1, 2, 3};
- * int length = 5;
- * PairCounts counts = get_stats(ids, length);
- * // The counts structure now contains the frequency of each consecutive pair in ids.
+ * @param arena Pointer to the Arena that owns `data`.
+ * @param subsystem The accounting category of the array.
+ * @param data The array to grow, or NULL.
+ * @param old_size The size `data` was allocated with.
+ * @param new_size The size needed; must not be smaller than `old_size`.
+ * @return Pointer to the grown array, or NULL if the allocator fails.
+ */
+void *arena_grow(Arena *arena, MemorySubsystem subsystem, void *data, size_t old_size, size_t new_size)
+{
+    ArenaBlock *block = arena->blocks;
+    if (data != NULL && block != NULL)
+    {
+        size_t aligned_old = (old_size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+        size_t aligned_new = (new_size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+        unsigned char *block_data = (unsigned char *)(block + 1);
+        block_data += (ARENA_ALIGNMENT - (uintptr_t)block_data % ARENA_ALIGNMENT) % ARENA_ALIGNMENT;
+        if ((unsigned char *)data + aligned_old == block_data + block->used &&
+            block->size - block->used >= aligned_new - aligned_old)
+        {
+            block->used += aligned_new - aligned_old;
+            arena->carved[subsystem] += aligned_new - aligned_old;
+            account_memory(subsystem, aligned_new - aligned_old);
+            return data;
+        }
+    }
+    void *grown = arena_alloc(arena, subsystem, new_size);
+    if (grown != NULL && data != NULL)
+    {
+        memcpy(grown, data, old_size);
+    }
+    return grown;
+}
+
+/**
+ * Returns every block of an arena to its allocator. All memory carved from the arena
+ * becomes invalid; the arena can be reused afterwards.
+ */
+void arena_release(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        account_memory(MEMORY_TOTAL, -(long long)(sizeof(ArenaBlock) + ARENA_ALIGNMENT + block->size));
+        arena->allocator.release(arena->allocator.context, block, sizeof(ArenaBlock) + ARENA_ALIGNMENT + block->size);
+        block = next;
+    }
+    for (int s = 0; s < MEMORY_SUBSYSTEMS; s++)
+    {
+        account_memory(s, -(long long)arena->carved[s]);
+    }
+    init_arena(arena, arena->allocator);
+}
+
+/**
+ * Packs two token ids into a PairKey.
+ */
+PairKey pair_key(int first, int second)
+{
+    return (uint64_t)(uint32_t)first << 32 | (uint32_t)second;
+}
+
+PairKey pack_pair(Pair pair)
+{
+    return pair_key(pair.first, pair.second);
+}
+
+Pair unpack_pair(PairKey key)
+{
+    Pair pair = {(int)(uint32_t)(key >> 32), (int)(uint32_t)key};
+    return pair;
+}
+
+/**
+ * Hashes a packed pair into a slot index for a table of the given power-of-two capacity,
+ * using the high bits of a multiplicative hash.
+ */
+int hash_pair(PairKey key, int capacity)
+{
+    uint64_t h = (key ^ key >> 29) * 0x9E3779B97F4A7C15ull;
+    return (int)(h >> 32) & (capacity - 1);
+}
+
+/**
+ * Returns non-zero if both ids of `key` are byte-level ids (below 256), i.e. the pair
+ * can be looked up in a dense BYTE_PAIR_TABLE_SIZE table at byte_pair_index(key).
+ */
+int is_byte_pair(PairKey key)
+{
+    return (key & 0xFFFFFF00FFFFFF00ull) == 0;
+}
+
+/**
+ * Returns first * 256 + second for a byte pair, the index of its dense table entry.
+ */
+int byte_pair_index(PairKey key)
+{
+    return (int)(key >> 24 | key) & 0xFFFF;
+}
+
+void init_pair_counts(PairCounts *counts)
+{
+    counts->keys = NULL;
+    counts->counts = NULL;
+    counts->size = 0;
+    counts->capacity = 0;
+    counts->arena = NULL;
+    counts->subsystem = MEMORY_PAIR_COUNTS;
+    counts->index = NULL;
+    counts->index_capacity = 0;
+    counts->byte_pairs = NULL;
+}
+
+/**
+ * Allocates `size` bytes for a PairCounts structure from its arena, or from tracked heap
+ * allocations if it has none.
+ */
+void *pair_counts_alloc(PairCounts *counts, size_t size)
+{
+    return counts->arena != NULL ? arena_alloc(counts->arena, counts->subsystem, size) : basic_alloc(counts->subsystem, size);
+}
+
+/**
+ * Returns the slot of the hash index or dense byte-pair table that holds `key`'s entry,
+ * or the empty slot where it belongs if the pair is not present.
+ */
+int *find_pair_slot(PairCounts *counts, PairKey key)
+{
+    if (counts->byte_pairs != NULL && is_byte_pair(key))
+    {
+        return &counts->byte_pairs[byte_pair_index(key)];
+    }
+    int mask = counts->index_capacity - 1;
+    int slot = hash_pair(key, counts->index_capacity);
+    while (counts->index[slot] != 0 && counts->keys[counts->index[slot] - 1] != key)
+    {
+        slot = (slot + 1) & mask;
+    }
+    return &counts->index[slot];
+}
+
+/**
+ * Refills the hash index of a PairCounts structure from its pairs. Pairs kept in the
+ * dense byte-pair table are not hashed.
+ */
+void reindex_pair_counts(PairCounts *counts)
+{
+    memset(counts->index, 0, counts->index_capacity * sizeof(int));
+    for (int i = 0; i < counts->size; i++)
+    {
+        if (counts->byte_pairs == NULL || !is_byte_pair(counts->keys[i]))
+        {
+            *find_pair_slot(counts, counts->keys[i]) = i + 1;
+        }
+    }
+}
+
+/**
+ * Rebuilds the hash index of a PairCounts structure at twice its capacity. An index that
+ * is already that size is refilled in place, so repeated rebuilds of an arena-backed
+ * structure do not leak.
+ */
+void rebuild_pair_index(PairCounts *counts)
+{
+    if (counts->index == NULL || counts->index_capacity != counts->capacity * 2)
+    {
+        if (counts->arena == NULL)
+        {
+            basic_free(counts->index);
+        }
+        counts->index_capacity = counts->capacity * 2;
+        counts->index = pair_counts_alloc(counts, counts->index_capacity * sizeof(int));
+    }
+    reindex_pair_counts(counts);
+}
+
+/**
+ * Gives a PairCounts structure a dense 256x256 table for pairs of byte-level ids. Those
+ * pairs are then found by direct indexing instead of hashing, which matters because they
+ * dominate the early passes of training. The table costs 256 KiB and must be enabled
+ * while the structure is empty.
+ *
+ * @param counts A pointer to an empty PairCounts structure.
+ */
+void enable_byte_pair_table(PairCounts *counts)
+{
+    if (counts->byte_pairs == NULL)
+    {
+        counts->byte_pairs = pair_counts_alloc(counts, BYTE_PAIR_TABLE_SIZE * sizeof(int));
+        memset(counts->byte_pairs, 0, BYTE_PAIR_TABLE_SIZE * sizeof(int));
+    }
+}
+
+/**
+ * Empties a PairCounts structure while keeping all of its storage, including the index and
+ * byte-pair table, for reuse.
+ */
+void clear_pair_counts(PairCounts *counts)
+{
+    if (counts->byte_pairs != NULL)
+    {
+        // Only the touched slots need resetting, which is cheaper than clearing 256 KiB
+        for (int i = 0; i < counts->size; i++)
+        {
+            if (is_byte_pair(counts->keys[i]))
+            {
+                counts->byte_pairs[byte_pair_index(counts->keys[i])] = 0;
+            }
+        }
+    }
+    if (counts->index != NULL)
+    {
+        memset(counts->index, 0, counts->index_capacity * sizeof(int));
+    }
+    counts->size = 0;
+}
+
+/**
+ * Doubles the capacity of a PairCounts structure, taking the storage from its arena if
+ * it has one and from tracked heap allocations otherwise.
+ */
+void grow_pair_counts(PairCounts *counts)
+{
+    int old_capacity = counts->capacity;
+    counts->capacity = old_capacity == 0 ? 4 : old_capacity * 2;
+    if (counts->arena != NULL)
+    {
+        counts->keys = arena_grow(counts->arena, counts->subsystem, counts->keys,
+                                  old_capacity * sizeof(PairKey), counts->capacity * sizeof(PairKey));
+        counts->counts = arena_grow(counts->arena, counts->subsystem, counts->counts,
+                                    old_capacity * sizeof(int64_t), counts->capacity * sizeof(int64_t));
+    }
+    else
+    {
+        counts->keys = basic_realloc(counts->subsystem, counts->keys, counts->capacity * sizeof(PairKey));
+        counts->counts = basic_realloc(counts->subsystem, counts->counts, counts->capacity * sizeof(int64_t));
+    }
+    if (counts->index != NULL)
+    {
+        rebuild_pair_index(counts);
+    }
+}
+
+/**
+ * Releases the storage of a heap-backed PairCounts structure. Arena-backed structures
+ * are released with their arena.
+ */
+void free_pair_counts(PairCounts *counts)
+{
+    if (counts->arena == NULL)
+    {
+        basic_free(counts->keys);
+        basic_free(counts->counts);
+        basic_free(counts->index);
+        basic_free(counts->byte_pairs);
+    }
+    init_pair_counts(counts);
+}
+
+/**
+ * find_pair_slot for a structure whose hash index may not be built yet; the index is
+ * built on first use.
+ */
+int *pair_slot(PairCounts *counts, PairKey key)
+{
+    if (counts->index == NULL)
+    {
+        if (counts->capacity == 0)
+        {
+            grow_pair_counts(counts);
+        }
+        rebuild_pair_index(counts);
+    }
+    return find_pair_slot(counts, key);
+}
+
+/**
+ * Appends `key` with `count` as a new entry. `slot` is the empty slot pair_slot returned
+ * for the key, so callers that decide whether to insert after looking a pair up probe
+ * only once.
+ */
+void insert_pair_key(PairCounts *counts, PairKey key, int *slot, int64_t count)
+{
+    if (counts->size == counts->capacity)
+    {
+        grow_pair_counts(counts);
+        slot = find_pair_slot(counts, key);
+    }
+    counts->keys[counts->size] = key;
+    counts->counts[counts->size] = count;
+    counts->size++;
+    *slot = counts->size;
+}
+
+/**
+ * Returns 0 if counting may skip `key` because `live` shows it cannot reach the minimum
+ * frequency, and 1 otherwise, including for every pair when there is no previous pass.
+ */
+int pair_may_live(LivePairs *live, PairKey key)
+{
+    if (live == NULL || live->previous == NULL)
+    {
+        return 1;
+    }
+    Pair pair = unpack_pair(key);
+    if (pair.first >= live->first_new_id || pair.second >= live->first_new_id)
+    {
+        return 1;
+    }
+    return *pair_slot(live->previous, key) != 0;
+}
+
+/**
+ * Drops the pairs counted fewer than `min_count` times, keeping the rest in order of
+ * first occurrence, so argmax and batch selection only scan the pairs that can still win.
+ */
+void prune_pair_counts(PairCounts *counts, int64_t min_count)
+{
+    if (min_count <= 1)
+    {
+        return; // Every counted pair occurs at least once
+    }
+    int kept = 0;
+    for (int i = 0; i < counts->size; i++)
+    {
+        PairKey key = counts->keys[i];
+        int *byte_slot = counts->byte_pairs != NULL && is_byte_pair(key) ? &counts->byte_pairs[byte_pair_index(key)] : NULL;
+        if (counts->counts[i] < min_count)
+        {
+            if (byte_slot != NULL)
+            {
+                *byte_slot = 0;
+            }
+            continue;
+        }
+        if (byte_slot != NULL)
+        {
+            *byte_slot = kept + 1;
+        }
+        counts->keys[kept] = key;
+        counts->counts[kept] = counts->counts[i];
+        kept++;
+    }
+    if (kept < counts->size)
+    {
+        counts->size = kept;
+        if (counts->index != NULL)
+        {
+            reindex_pair_counts(counts);
+        }
+    }
+}
+
+/**
+ * add_pair_count for a packed pair; this is the form the counting loops call.
+ */
+void add_pair_key(PairCounts *counts, PairKey key, int64_t initial_count)
+{
+    int *slot = pair_slot(counts, key);
+    if (*slot != 0)
+    {
+        counts->counts[*slot - 1] += initial_count;
+        return;
+    }
+    insert_pair_key(counts, key, slot, initial_count);
+}
+
+/**
+ * Adds a pair count to the PairCounts structure or increments the count
+ * if the pair already exists.
+ *
+ * This function searches for the given pair in the PairCounts structure. If found,
+ * it increments the existing count by the specified initial_count. If the pair
+ * is not found, the pair and the initial_count are added to the structure.
+ * If necessary, the function grows the PairCounts arrays when the current capacity
+ * is reached. Pairs are located through a hash index built on first use, or through
+ * the dense byte-pair table for byte pairs when enable_byte_pair_table was called.
+ * New pairs are always appended, so entries stay in order of first insertion.
+ *
+ * @param counts A pointer to the PairCounts structure where the pair and count are to be added.
+ * @param pair The pair of integers (defined in a Pair structure) to be added or updated.
+ * @param initial_count The count to be added for the pair. If the pair exists, this value
+ *                      is added to the existing count.
+ */
+void add_pair_count(PairCounts *counts, Pair pair, int64_t initial_count)
+{
+    add_pair_key(counts, pack_pair(pair), initial_count);
+}
+
+/**
+ * Appends a merge to the end of a merge list, growing its arena-backed storage as needed.
+ *
+ * @param merges A pointer to the MergeList to append to.
+ * @param pair The pair of tokens being merged.
+ * @param id The id of the token the pair merges into.
+ */
+void append_merge(MergeList *merges, Pair pair, int id)
+{
+    if (merges->size == merges->capacity)
+    {
+        int old_capacity = merges->capacity;
+        merges->capacity = old_capacity == 0 ? 4 : old_capacity * 2;
+        merges->keys = arena_grow(merges->arena, MEMORY_MERGES, merges->keys,
+                                  old_capacity * sizeof(PairKey), merges->capacity * sizeof(PairKey));
+        merges->ids = arena_grow(merges->arena, MEMORY_MERGES, merges->ids,
+                                 old_capacity * sizeof(int32_t), merges->capacity * sizeof(int32_t));
+    }
+    merges->keys[merges->size] = pack_pair(pair);
+    merges->ids[merges->size] = id;
+    merges->size++;
+}
+
+/**
+ * Counts consecutive pairs of `ids` into an existing PairCounts structure, discarding its
+ * previous contents but keeping its storage. Reusing one structure across calls, as the
+ * training loop does, avoids reallocating the pair arrays on every pass. Byte pairs are
+ * counted through a dense 256x256 table; all other pairs through the hash index.
+ *
+ * @param counts A pointer to the PairCounts structure to fill.
+ * @param ids An array of integers for which consecutive pairs are to be counted.
+ * @param length The number of elements in the ids array.
+ */
+void get_stats_into(PairCounts *counts, int *ids, size_t length)
+{
+    clear_pair_counts(counts);
+    enable_byte_pair_table(counts);
+    for (size_t i = 0; i + 1 < length; i++)
+    {
+        add_pair_key(counts, pair_key(ids[i], ids[i + 1]), 1);
+    }
+}
+
+/**
+ * get_stats_into for training with a minimum frequency: pairs that `live` shows to be
+ * below it are never tabled, so from the second pass on the table holds only the pairs
+ * that survived the previous pass and those of newly merged tokens.
+ */
+void get_live_stats_into(PairCounts *counts, int *ids, size_t length, LivePairs *live)
+{
+    if (live == NULL || live->previous == NULL)
+    {
+        get_stats_into(counts, ids, length);
+        return;
+    }
+    clear_pair_counts(counts);
+    enable_byte_pair_table(counts);
+    for (size_t i = 0; i + 1 < length; i++)
+    {
+        PairKey key = pair_key(ids[i], ids[i + 1]);
+        int *slot = pair_slot(counts, key);
+        if (*slot != 0)
+        {
+            counts->counts[*slot - 1]++;
+        }
+        else if (pair_may_live(live, key))
+        {
+            insert_pair_key(counts, key, slot, 1);
+        }
+    }
+}
+
+/**
+ * Generates a PairCounts structure containing counts of consecutive integer pairs
+ * in the provided array. This function processes an array of integers and counts
+ * how many times each consecutive pair (n, n+1) appears.
+ *
+ * The function initializes a PairCounts structure, iterates through the array of
+ * integers, and for each consecutive pair of elements, it updates or adds a new
+ * entry in the PairCounts structure using the add_pair_count function.
+ *
+ * @param ids An array of integers for which consecutive pairs are to be counted.
+ * @param length The number of elements in the ids array.
+ * @return A PairCounts structure populated with pairs and their corresponding counts.
+ *
+ * Example usage:
+ * int ids[] = {1, 2, 1, 2, 3};
+ * int length = 5;
+ * PairCounts counts = get_stats(ids, length);
+ * // The counts structure now contains the frequency of each consecutive pair in ids.
+ * free_pair_counts(&counts);
+ */
+PairCounts get_stats(int *ids, size_t length)
+{
+    PairCounts counts;
+    init_pair_counts(&counts);
+    get_stats_into(&counts, ids, length);
+    return counts;
+}
+
+/**
+ * Allocates sort engine buffers for sequences of up to `length` ids from `arena`. Longer
+ * sequences are sorted in windows, so the buffers never exceed MAX_SORT_WINDOW pairs.
+ */
+void init_sort_stats_buffers(Arena *arena, SortStatsBuffers *buffers, size_t length)
+{
+    size_t n = length > 1 ? length - 1 : 1;
+    n = n < MAX_SORT_WINDOW ? n : MAX_SORT_WINDOW;
+    buffers->keys = arena_alloc(arena, MEMORY_PAIR_COUNTS, n * sizeof(PairKey));
+    buffers->keys_swap = arena_alloc(arena, MEMORY_PAIR_COUNTS, n * sizeof(PairKey));
+    buffers->positions = arena_alloc(arena, MEMORY_PAIR_COUNTS, n * sizeof(uint32_t));
+    buffers->positions_swap = arena_alloc(arena, MEMORY_PAIR_COUNTS, n * sizeof(uint32_t));
+    buffers->run_at = arena_alloc(arena, MEMORY_PAIR_COUNTS, n * sizeof(int));
+}
+
+/**
+ * Squeezes the two ids of a key next to each other so that radix passes only cover the
+ * bits ids actually use: a vocabulary under 2048 ids sorts in two passes, not six.
+ */
+uint64_t compact_pair_key(PairKey key, int id_bits)
+{
+    return (key >> 32) << id_bits | (key & (((uint64_t)1 << id_bits) - 1));
+}
+
+/**
+ * Radix sort worker: counts the digits of its range of keys for the current pass.
+ */
+void *radix_histogram(void *arg)
+{
+    RadixSortTask *task = arg;
+    PairKey *keys = task->buffers->keys;
+    memset(task->histogram, 0, RADIX_BUCKETS * sizeof(int));
+    for (int i = task->begin; i < task->end; i++)
+    {
+        task->histogram[(compact_pair_key(keys[i], task->id_bits) >> task->shift) & (RADIX_BUCKETS - 1)]++;
+    }
+    return NULL;
+}
+
+/**
+ * Radix sort worker: moves its range of keys and positions to their offsets for the
+ * current pass. Offsets were assigned so that ranges land in order, keeping the sort stable.
+ */
+void *radix_scatter(void *arg)
+{
+    RadixSortTask *task = arg;
+    SortStatsBuffers *buffers = task->buffers;
+    for (int i = task->begin; i < task->end; i++)
+    {
+        int digit = (compact_pair_key(buffers->keys[i], task->id_bits) >> task->shift) & (RADIX_BUCKETS - 1);
+        int destination = task->histogram[digit]++;
+        buffers->keys_swap[destination] = buffers->keys[i];
+        buffers->positions_swap[destination] = buffers->positions[i];
+    }
+    return NULL;
+}
+
+/**
+ * Runs `worker` over every task, handling the first on the calling thread along with
+ * those of any threads that could not be started. Tasks write disjoint ranges, so the
+ * order they run in does not matter.
+ */
+void run_radix_tasks(RadixSortTask *tasks, int num_tasks, pthread_t *threads, void *(*worker)(void *))
+{
+    int started = 1;
+    while (started < num_tasks && pthread_create(&threads[started], NULL, worker, &tasks[started]) == 0)
+    {
+        started++;
+    }
+    worker(&tasks[0]);
+    for (int t = started; t < num_tasks; t++)
+    {
+        worker(&tasks[t]);
+    }
+    for (int t = 1; t < started; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+/**
+ * Sorts the first `count` keys of `buffers` together with their positions by a parallel
+ * LSD radix sort. Each pass splits the keys into contiguous ranges, one per thread; the
+ * threads histogram their ranges, the histograms are turned into per-thread offsets in
+ * (digit, thread) order, and the threads scatter. Because earlier ranges always scatter
+ * ahead of later ones, every pass is stable, so equal keys keep ascending positions.
+ *
+ * @param buffers The keys and positions to sort; the sorted result is left in `keys` and
+ *                `positions`.
+ * @param count The number of keys.
+ * @param id_bits The number of significant bits in each id of the keys.
+ * @param num_threads The number of threads to use; small inputs use one.
+ */
+void radix_sort_pairs(SortStatsBuffers *buffers, int count, int id_bits, int num_threads)
+{
+    if (num_threads < 1 || count < PARALLEL_SORT_MIN_KEYS)
+    {
+        num_threads = 1;
+    }
+    RadixSortTask *tasks = basic_alloc(MEMORY_OTHER, num_threads * sizeof(RadixSortTask));
+    int *histograms = basic_alloc(MEMORY_OTHER, (size_t)num_threads * RADIX_BUCKETS * sizeof(int));
+    pthread_t *threads = basic_alloc(MEMORY_OTHER, num_threads * sizeof(pthread_t));
+    for (int t = 0; t < num_threads; t++)
+    {
+        tasks[t].buffers = buffers;
+        tasks[t].begin = count * (long long)t / num_threads;
+        tasks[t].end = count * (long long)(t + 1) / num_threads;
+        tasks[t].id_bits = id_bits;
+        tasks[t].histogram = histograms + (size_t)t * RADIX_BUCKETS;
+    }
+
+    for (int shift = 0; shift < 2 * id_bits; shift += RADIX_BITS)
+    {
+        for (int t = 0; t < num_threads; t++)
+        {
+            tasks[t].shift = shift;
+        }
+        run_radix_tasks(tasks, num_threads, threads, radix_histogram);
+        int offset = 0;
+        for (int digit = 0; digit < RADIX_BUCKETS; digit++)
+        {
+            for (int t = 0; t < num_threads; t++)
+            {
+                int digit_count = tasks[t].histogram[digit];
+                tasks[t].histogram[digit] = offset;
+                offset += digit_count;
+            }
+        }
+        run_radix_tasks(tasks, num_threads, threads, radix_scatter);
+
+        PairKey *keys = buffers->keys;
+        buffers->keys = buffers->keys_swap;
+        buffers->keys_swap = keys;
+        uint32_t *positions = buffers->positions;
+        buffers->positions = buffers->positions_swap;
+        buffers->positions_swap = positions;
+    }
+
+    basic_free(threads);
+    basic_free(histograms);
+    basic_free(tasks);
+}
+
+/**
+ * Counts consecutive pairs of `ids` like get_stats_into, but by sorting instead of
+ * hashing: every pair is written out as a packed key with its position, the keys are
+ * radix-sorted, and each run of equal keys becomes one entry. Memory is touched in long
+ * sequential sweeps rather than random probes, which holds up better than a hash table
+ * once the distinct pairs of a large corpus no longer fit in cache.
+ *
+ * Entries are emitted in order of first occurrence, exactly as the hash engine produces
+ * them, so training picks the same pair on ties whichever engine counted. The stable sort
+ * leaves each run's first occurrence at its head; runs are then collected by scanning
+ * positions in order. Sequences of more than MAX_SORT_WINDOW pairs are sorted one window
+ * at a time (windows share their boundary id, so no pair is lost) and accumulated.
+ *
+ * With `live`, runs of pairs it shows to be dead are dropped before they reach the table.
+ * A single window also knows every count exactly, so when the ids are the whole corpus
+ * runs shorter than live->min_count are dropped too, and the table never holds a pair
+ * that training would prune.
+ *
+ * @param counts The PairCounts structure to fill; its previous contents are discarded.
+ * @param ids An array of integers for which consecutive pairs are to be counted.
+ * @param length The number of elements in the ids array.
+ * @param buffers Buffers from init_sort_stats_buffers for at least `length` ids.
+ * @param num_threads The number of threads the radix sort may use.
+ * @param live What is known about dead pairs, or NULL to count every pair.
+ *
+ * Example usage:
+ * SortStatsBuffers buffers;
+ * init_sort_stats_buffers(&arena, &buffers, length);
+ * get_stats_sorted(&stats, ids, length, &buffers, 8, NULL);
+ */
+void get_stats_sorted(PairCounts *counts, int *ids, size_t length, SortStatsBuffers *buffers, int num_threads,
+                      LivePairs *live)
+{
+    clear_pair_counts(counts);
+    size_t total = length > 1 ? length - 1 : 0;
+    int max_id = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        max_id = ids[i] > max_id ? ids[i] : max_id;
+    }
+    int id_bits = 1;
+    while (id_bits < 31 && (1 << id_bits) <= max_id)
+    {
+        id_bits++;
+    }
+
+    for (size_t start = 0; start < total; start += MAX_SORT_WINDOW)
+    {
+        int count = total - start < MAX_SORT_WINDOW ? total - start : MAX_SORT_WINDOW;
+        int *window = ids + start;
+        for (int i = 0; i < count; i++)
+        {
+            buffers->keys[i] = pair_key(window[i], window[i + 1]);
+            buffers->positions[i] = i;
+            buffers->run_at[i] = -1;
+        }
+        radix_sort_pairs(buffers, count, id_bits, num_threads);
+
+        // Run-length encode; the run length is parked in the now unused swap buffer
+        int64_t min_run = live != NULL && total <= MAX_SORT_WINDOW ? live->min_count : 0;
+        int num_runs = 0;
+        for (int i = 0; i < count;)
+        {
+            int j = i + 1;
+            while (j < count && buffers->keys[j] == buffers->keys[i])
+            {
+                j++;
+            }
+            if (j - i >= min_run && pair_may_live(live, buffers->keys[i]))
+            {
+                buffers->run_at[buffers->positions[i]] = i;
+                buffers->positions_swap[i] = j - i;
+                num_runs++;
+            }
+            i = j;
+        }
+
+        if (start > 0)
+        {
+            // Later windows merge into the totals in first-occurrence order
+            for (int position = 0; position < count; position++)
+            {
+                int run = buffers->run_at[position];
+                if (run >= 0)
+                {
+                    add_pair_key(counts, buffers->keys[run], buffers->positions_swap[run]);
+                }
+            }
+            continue;
+        }
+        while (counts->capacity < num_runs)
+        {
+            grow_pair_counts(counts);
+        }
+        for (int position = 0; position < count; position++)
+        {
+            int run = buffers->run_at[position];
+            if (run >= 0)
+            {
+                counts->keys[counts->size] = buffers->keys[run];
+                counts->counts[counts->size] = buffers->positions_swap[run];
+                counts->size++;
+            }
+        }
+        if (counts->index != NULL || counts->byte_pairs != NULL || total > MAX_SORT_WINDOW)
+        {
+            // Keep the structure usable with add_pair_count
+            rebuild_pair_index(counts);
+            for (int i = 0; counts->byte_pairs != NULL && i < counts->size; i++)
+            {
+                if (is_byte_pair(counts->keys[i]))
+                {
+                    counts->byte_pairs[byte_pair_index(counts->keys[i])] = i + 1;
+                }
+            }
+        }
+    }
+}
+
+#if defined(__SSE2__) && !defined(__AVX2__)
+/**
+ * Signed 64-bit greater-than for SSE2, which only compares 32-bit lanes: the high halves
+ * decide unless they are equal, in which case the low halves decide as unsigned values.
+ */
+__m128i sse2_cmpgt_epi64(__m128i a, __m128i b)
+{
+    __m128i flip_low = _mm_set_epi32(0, (int)0x80000000u, 0, (int)0x80000000u);
+    __m128i greater = _mm_cmpgt_epi32(_mm_xor_si128(a, flip_low), _mm_xor_si128(b, flip_low));
+    __m128i equal = _mm_cmpeq_epi32(a, b);
+    __m128i high_greater = _mm_shuffle_epi32(greater, _MM_SHUFFLE(3, 3, 1, 1));
+    __m128i high_equal = _mm_shuffle_epi32(equal, _MM_SHUFFLE(3, 3, 1, 1));
+    __m128i low_greater = _mm_shuffle_epi32(greater, _MM_SHUFFLE(2, 2, 0, 0));
+    return _mm_or_si128(high_greater, _mm_and_si128(high_equal, low_greater));
+}
+#endif
+
+/**
+ * Returns the index of the largest of `n` counts, taking the lowest index on ties so that
+ * the first-seen pair wins, as in a plain left-to-right scan. Training calls this once per
+ * merge over every distinct pair, so it is vectorized: one pass finds the maximum with
+ * packed compare-and-select and no branches, and a second pass compares whole vectors
+ * against it to find the first position holding it, which usually ends early. AVX2 is
+ * used when the compiler targets it (e.g. -march=native), SSE2 on other x86-64 builds,
+ * and plain C elsewhere.
+ *
+ * @param counts The counts to scan.
+ * @param n The number of counts.
+ * @return The index of the first maximum, or -1 if `n` is zero.
+ *
+ * Example usage:
+ * int64_t counts[] = {3, 7, 2, 7};
+ * int best = argmax_counts(counts, 4); // 1
+ */
+int argmax_counts(const int64_t *counts, int n)
+{
+    if (n <= 0)
+    {
+        return -1;
+    }
+    int i = 0;
+    int64_t best = counts[0];
+#if defined(__AVX2__)
+    if (n >= 4)
+    {
+        __m256i maxima = _mm256_loadu_si256((const __m256i *)counts);
+        for (i = 4; i + 4 <= n; i += 4)
+        {
+            __m256i values = _mm256_loadu_si256((const __m256i *)(counts + i));
+            maxima = _mm256_blendv_epi8(maxima, values, _mm256_cmpgt_epi64(values, maxima));
+        }
+        int64_t lanes[4];
+        _mm256_storeu_si256((__m256i *)lanes, maxima);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            best = lanes[lane] > best ? lanes[lane] : best;
+        }
+    }
+#elif defined(__SSE2__)
+    if (n >= 2)
+    {
+        __m128i maxima = _mm_loadu_si128((const __m128i *)counts);
+        for (i = 2; i + 2 <= n; i += 2)
+        {
+            __m128i values = _mm_loadu_si128((const __m128i *)(counts + i));
+            __m128i greater = sse2_cmpgt_epi64(values, maxima);
+            maxima = _mm_or_si128(_mm_and_si128(greater, values), _mm_andnot_si128(greater, maxima));
+        }
+        int64_t lanes[2];
+        _mm_storeu_si128((__m128i *)lanes, maxima);
+        best = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    }
+#endif
+    for (; i < n; i++)
+    {
+        best = counts[i] > best ? counts[i] : best;
+    }
+
+    // Find the first position holding the maximum
+    i = 0;
+#if defined(__AVX2__)
+    __m256i target = _mm256_set1_epi64x(best);
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i equal = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(counts + i)), target);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(equal));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i target = _mm_set1_epi64x(best);
+    for (; i + 2 <= n; i += 2)
+    {
+        // Both 32-bit halves must match for a 64-bit lane to be equal
+        __m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(counts + i)), target);
+        equal = _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(equal));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (counts[i] != best)
+    {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * Merges consecutive pairs in an integer array that match a specified pair, replacing them
+ * with a single specified index. This function is typically used in tokenization processes
+ * where frequent pairs of tokens (or characters) are merged into a single new token to
+ * compress the sequence or to prepare for further processing.
+ *
+ * The function allocates a new integer array to store the result of the merge. For each
+ * pair of elements in the input array that matches the specified pair, the function inserts
+ * the new index (`idx`) into the new array instead of the pair. Elements not part of a matching
+ * pair are copied directly to the new array.
+ *
+ * @param ids Pointer to the original array of integers.
+ * @param length The number of elements in the `ids` array.
+ * @param pair The pair of integers to search for in the `ids` array. Consecutive elements
+ *             matching this pair are replaced in the output array.
+ * @param idx The new integer value that replaces each matching pair in the output array.
+ * @param new_length Pointer to an integer where the function will store the length of the
+ *                   new array.
+ * @return Pointer to the new array containing the merged integers; release it with free.
+ *
+ * Example usage:
+ * int ids[] = {1, 2, 3, 1, 2};
+ * int length = 5;
+ * Pair pair = {1, 2};
+ * size_t new_length;
+ * int* merged_ids = merge(ids, length, pair, 99, &new_length);
+ * // `merged_ids` will contain: {99, 3, 99}, `new_length` will be set to 3
+ */
+int *merge(int *ids, size_t length, Pair pair, int idx, size_t *new_length)
+{
+    int *newids = malloc(length * sizeof(int));
+    PairKey key = pack_pair(pair);
+    size_t j = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (i + 1 < length && pair_key(ids[i], ids[i + 1]) == key)
+        {
+            newids[j++] = idx;
+            i++; // Skip the next element
+        }
+        else
+        {
+            newids[j++] = ids[i];
+        }
+    }
+    *new_length = j;
+    return newids;
+}
+
+/**
+ * Merges every occurrence of `pair` in `ids` into `idx` in place, scanning left to right
+ * exactly like merge() but without allocating a new array.
+ *
+ * @param ids Token ids to merge; overwritten with the merged sequence.
+ * @param length The number of elements in `ids`.
+ * @param pair The pair of adjacent ids to replace.
+ * @param idx The id that replaces each occurrence of `pair`.
+ * @return The length of the merged sequence.
+ */
+size_t merge_in_place(int *ids, size_t length, Pair pair, int idx)
+{
+    PairKey key = pack_pair(pair);
+    size_t j = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (i + 1 < length && pair_key(ids[i], ids[i + 1]) == key)
+        {
+            ids[j++] = idx;
+            i++; // Skip the next element
+        }
+        else
+        {
+            ids[j++] = ids[i];
+        }
+    }
+    return j;
+}
+
+/**
+ * Empties a rank table, giving it room for `num_pairs` entries at no more than half load,
+ * and clears the dense byte-pair table that accompanies it. Storage an earlier reset carved
+ * from `arena` is reused when it is large enough, so rebuilding the table after every
+ * round of training does not leave a dead copy in the arena each time; only growing past
+ * the allocated entries carves a new array.
+ */
+void reset_rank_table(Arena *arena, RankTable *ranks, int num_pairs)
+{
+    int capacity = 8;
+    while (capacity < num_pairs * 2)
+    {
+        capacity *= 2;
+    }
+    if (ranks->allocated_entries == 0)
+    {
+        ranks->byte_pairs = arena_alloc(arena, MEMORY_MERGES, BYTE_PAIR_TABLE_SIZE * sizeof(int));
+    }
+    if (capacity > ranks->allocated_entries)
+    {
+        ranks->entries = arena_alloc(arena, MEMORY_MERGES, capacity * sizeof(RankEntry));
+        ranks->allocated_entries = capacity;
+    }
+    ranks->capacity = capacity;
+    memset(ranks->entries, 0xFF, capacity * sizeof(RankEntry)); // EMPTY_PAIR_KEY, idx -1
+    memset(ranks->byte_pairs, 0xFF, BYTE_PAIR_TABLE_SIZE * sizeof(int));
+}
+
+/**
+ * Inserts a pair and the id it merges into. The table must have been sized by
+ * reset_rank_table for at least as many pairs as are inserted.
+ */
+void insert_rank(RankTable *ranks, PairKey key, int idx)
+{
+    int slot = hash_pair(key, ranks->capacity);
+    while (ranks->entries[slot].key != EMPTY_PAIR_KEY)
+    {
+        slot = (slot + 1) & (ranks->capacity - 1);
+    }
+    ranks->entries[slot].key = key;
+    ranks->entries[slot].idx = idx;
+    if (is_byte_pair(key))
+    {
+        ranks->byte_pairs[byte_pair_index(key)] = idx;
+    }
+}
+
+/**
+ * Rebuilds the tokenizer's rank table from its merges. The table maps each merged pair
+ * to the id it produces, which doubles as the pair's rank since merges are assigned
+ * increasing ids in the order they were learned. It is sized to at most half full, so
+ * lookups during encoding take one or two probes.
+ *
+ * @param tokenizer Pointer to a heap-owned BasicTokenizer whose rank table is rebuilt.
+ */
+void build_rank_table(BasicTokenizer *tokenizer)
+{
+    reset_rank_table(&tokenizer->arena, &tokenizer->ranks, tokenizer->merges.size);
+    memset(&tokenizer->ranks.perfect, 0, sizeof(PerfectHash)); // Stale until freeze_merges runs again
+    for (int i = 0; i < tokenizer->merges.size; i++)
+    {
+        insert_rank(&tokenizer->ranks, tokenizer->merges.keys[i], tokenizer->merges.ids[i]);
+    }
+}
+
+/**
+ * Finalizes a 64-bit hash (the MurmurHash3 fmix64 mixer).
+ */
+uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+/**
+ * Returns the slot `key` hashes to in a perfect hash table of `num_slots` slots when
+ * displaced by `seed`. Ranges are reduced by multiply-shift rather than modulo.
+ */
+int perfect_hash_probe(PairKey key, uint32_t seed, int num_slots)
+{
+    uint32_t h = (uint32_t)mix64(key ^ (seed * 0x9E3779B97F4A7C15ull));
+    return (int)(((uint64_t)h * (uint32_t)num_slots) >> 32);
+}
+
+/**
+ * Returns the bucket `key` belongs to in a perfect hash table of `num_buckets` buckets.
+ */
+int perfect_hash_bucket(PairKey key, int num_buckets)
+{
+    uint32_t h = (uint32_t)(mix64(key) >> 32);
+    return (int)(((uint64_t)h * (uint32_t)num_buckets) >> 32);
+}
+
+/**
+ * Returns the only slot of `perfect` that can hold `key`.
+ */
+int perfect_hash_slot(const PerfectHash *perfect, PairKey key)
+{
+    return perfect_hash_probe(key, perfect->seeds[perfect_hash_bucket(key, perfect->num_buckets)], perfect->num_slots);
+}
+
+/**
+ * Tries to place every merge into `num_slots` slots using hash and displace: merges are
+ * grouped into buckets, and buckets are processed largest first, each trying seeds until
+ * all of its merges land on distinct free slots. Returns 0 on success, -1 if some bucket
+ * exhausted PERFECT_HASH_MAX_SEED seeds, -2 if the merges hold the same pair twice,
+ * which no number of slots can place, or -3 if a bucket is too large to place at all,
+ * which only more buckets fix.
+ */
+int place_perfect_hash(PerfectHash *perfect, const MergeList *merges, int num_slots)
+{
+    int n = merges->size;
+    int num_buckets = perfect->num_buckets;
+    perfect->num_slots = num_slots;
+    memset(perfect->slots, 0xFF, num_slots * sizeof(RankEntry)); // EMPTY_PAIR_KEY, idx -1
+
+    // Group merge indices by bucket with a counting sort
+    int *bucket_start = basic_alloc(MEMORY_OTHER, (num_buckets + 1) * sizeof(int));
+    int *members = basic_alloc(MEMORY_OTHER, (n > 0 ? n : 1) * sizeof(int));
+    memset(bucket_start, 0, (num_buckets + 1) * sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+        bucket_start[perfect_hash_bucket(merges->keys[i], num_buckets) + 1]++;
+    }
+    int max_size = 0;
+    for (int b = 0; b < num_buckets; b++)
+    {
+        max_size = bucket_start[b + 1] > max_size ? bucket_start[b + 1] : max_size;
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    int *fill = basic_alloc(MEMORY_OTHER, num_buckets * sizeof(int));
+    memcpy(fill, bucket_start, num_buckets * sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+        members[fill[perfect_hash_bucket(merges->keys[i], num_buckets)]++] = i;
+    }
+
+    // Equal pairs share a bucket, so duplicates are found before any seed is tried
+    int status = 0;
+    for (int b = 0; b < num_buckets && status == 0; b++)
+    {
+        for (int j = bucket_start[b]; j < bucket_start[b + 1] && status == 0; j++)
+        {
+            for (int q = bucket_start[b]; q < j && status == 0; q++)
+            {
+                status = merges->keys[members[q]] == merges->keys[members[j]] ? -2 : 0;
+            }
+        }
+    }
+    if (status != 0)
+    {
+        basic_free(fill);
+        basic_free(members);
+        basic_free(bucket_start);
+        return status;
+    }
+
+    // Order buckets by decreasing size, again with a counting sort
+    int *order = fill;
+    int *size_start = basic_alloc(MEMORY_OTHER, (max_size + 2) * sizeof(int));
+    memset(size_start, 0, (max_size + 2) * sizeof(int));
+    for (int b = 0; b < num_buckets; b++)
+    {
+        size_start[max_size - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+    }
+    for (int k = 0; k <= max_size; k++)
+    {
+        size_start[k + 1] += size_start[k];
+    }
+    for (int b = 0; b < num_buckets; b++)
+    {
+        order[size_start[max_size - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+    }
+
+    int placed[PERFECT_HASH_BUCKET_SIZE * 8];
+    for (int k = 0; k < num_buckets && status == 0; k++)
+    {
+        int b = order[k];
+        int count = bucket_start[b + 1] - bucket_start[b];
+        perfect->seeds[b] = 0;
+        if (count == 0)
+        {
+            continue;
+        }
+        if (count > (int)(sizeof(placed) / sizeof(placed[0])))
+        {
+            status = -3; // Pathologically large bucket; more slots do not help
+            break;
+        }
+        uint32_t seed = 0;
+        for (; seed < PERFECT_HASH_MAX_SEED; seed++)
+        {
+            int ok = 1;
+            for (int j = 0; j < count && ok; j++)
+            {
+                placed[j] = perfect_hash_probe(merges->keys[members[bucket_start[b] + j]], seed, num_slots);
+                ok = perfect->slots[placed[j]].key == EMPTY_PAIR_KEY;
+                for (int q = 0; q < j && ok; q++)
+                {
+                    ok = placed[q] != placed[j];
+                }
+            }
+            if (ok)
+            {
+                break;
+            }
+        }
+        if (seed == PERFECT_HASH_MAX_SEED)
+        {
+            status = -1;
+            break;
+        }
+        perfect->seeds[b] = seed;
+        for (int j = 0; j < count; j++)
+        {
+            int i = members[bucket_start[b] + j];
+            perfect->slots[placed[j]].key = merges->keys[i];
+            perfect->slots[placed[j]].idx = merges->ids[i];
+        }
+    }
+
+    basic_free(size_start);
+    basic_free(fill);
+    basic_free(members);
+    basic_free(bucket_start);
+    return status;
+}
+
+/**
+ * Freezes a tokenizer's merges by compiling them into a minimal perfect hash. After this,
+ * looking up the rank of any pair that is not a byte pair reads one seed and probes exactly
+ * one slot, with no collision chains, so encode's hot loop has a fixed cost per pair.
+ *
+ * The table has one slot per merge; in the rare case that no displacement fits, it is
+ * rebuilt with a few percent more slots, and if one bucket drew too many merges to place,
+ * with twice the buckets. If the merge list holds the same pair twice no
+ * table exists, so the function reports an error at once and leaves lookups on the hash
+ * table.
+ * Training, and the minbpe and tiktoken loaders, freeze automatically when they finish,
+ * and the result is stored in model files; call this again after changing merges by any
+ * other means.
+ *
+ * @param tokenizer Pointer to a heap-owned BasicTokenizer whose merges are compiled.
+ *
+ * Example usage:
+ * append_merge(&tokenizer->merges, pair, new_idx); // Manual edits...
+ * build_rank_table(tokenizer);
+ * freeze_merges(tokenizer);                         // ...then recompile
+ */
+void freeze_merges(BasicTokenizer *tokenizer)
+{
+    PerfectHash *perfect = &tokenizer->ranks.perfect;
+    int n = tokenizer->merges.size;
+    int max_slots = 2 * n + 1;
+
+    // Placement is tried in scratch tables of the largest size, reused by every retry
+    PerfectHash trial;
+    trial.num_buckets = n / PERFECT_HASH_BUCKET_SIZE > 0 ? n / PERFECT_HASH_BUCKET_SIZE : 1;
+    trial.seeds = basic_alloc(MEMORY_OTHER, trial.num_buckets * sizeof(uint32_t));
+    trial.slots = basic_alloc(MEMORY_OTHER, max_slots * sizeof(RankEntry));
+    int status = -1;
+    for (int num_slots = n > 0 ? n : 1; num_slots <= max_slots && status == -1;)
+    {
+        status = place_perfect_hash(&trial, &tokenizer->merges, num_slots);
+        if (status == -3 && trial.num_buckets < n)
+        {
+            // The bucket hash is fixed, so only splitting the buckets breaks up a crowded one
+            trial.num_buckets = 2 * trial.num_buckets < n ? 2 * trial.num_buckets : n;
+            basic_free(trial.seeds);
+            trial.seeds = basic_alloc(MEMORY_OTHER, trial.num_buckets * sizeof(uint32_t));
+            status = -1;
+            continue;
+        }
+        num_slots += num_slots / 32 + 1;
+    }
+    if (status == 0)
+    {
+        // Storage from an earlier freeze is reused; when it must grow it doubles, so
+        // refreezing after every few merges carves only a bounded total from the arena
+        RankTable *ranks = &tokenizer->ranks;
+        if (trial.num_buckets > ranks->allocated_seeds)
+        {
+            int size = trial.num_buckets > 2 * ranks->allocated_seeds ? trial.num_buckets : 2 * ranks->allocated_seeds;
+            ranks->seed_storage = arena_alloc(&tokenizer->arena, MEMORY_MERGES, size * sizeof(uint32_t));
+            ranks->allocated_seeds = size;
+        }
+        if (trial.num_slots > ranks->allocated_slots)
+        {
+            int size = trial.num_slots > 2 * ranks->allocated_slots ? trial.num_slots : 2 * ranks->allocated_slots;
+            ranks->slot_storage = arena_alloc(&tokenizer->arena, MEMORY_MERGES, size * sizeof(RankEntry));
+            ranks->allocated_slots = size;
+        }
+        perfect->num_buckets = trial.num_buckets;
+        perfect->num_slots = trial.num_slots;
+        perfect->seeds = ranks->seed_storage;
+        perfect->slots = ranks->slot_storage;
+        memcpy(perfect->seeds, trial.seeds, trial.num_buckets * sizeof(uint32_t));
+        memcpy(perfect->slots, trial.slots, trial.num_slots * sizeof(RankEntry));
+    }
+    else
+    {
+        // Lookups keep using the hash table
+        fprintf(stderr, status == -2 ? "Error: the merges hold the same pair twice; they cannot be frozen.\n"
+                                     : "Error: could not build a perfect hash over the merges.\n");
+        memset(perfect, 0, sizeof(PerfectHash));
+    }
+    basic_free(trial.seeds);
+    basic_free(trial.slots);
+}
+
+/**
+ * lookup_rank for a packed pair; this is the form apply_merges calls.
+ */
+int lookup_rank_key(const RankTable *ranks, PairKey key)
+{
+    if (ranks->byte_pairs != NULL && is_byte_pair(key))
+    {
+        return ranks->byte_pairs[byte_pair_index(key)];
+    }
+    if (ranks->perfect.slots != NULL)
+    {
+        const RankEntry *entry = &ranks->perfect.slots[perfect_hash_slot(&ranks->perfect, key)];
+        return entry->key == key ? entry->idx : -1;
+    }
+    if (ranks->entries == NULL)
+    {
+        return -1;
+    }
+    int slot = hash_pair(key, ranks->capacity);
+    while (ranks->entries[slot].key != EMPTY_PAIR_KEY)
+    {
+        if (ranks->entries[slot].key == key)
+        {
+            return ranks->entries[slot].idx;
+        }
+        slot = (slot + 1) & (ranks->capacity - 1);
+    }
+    return -1;
+}
+
+/**
+ * Looks up the id a pair merges into. Pairs of byte-level ids, which make up most
+ * lookups while encoding, are answered from the dense byte-pair table without hashing
+ * when the table is present. Other pairs take exactly one probe into the perfect hash
+ * once the merges are frozen, and go through the open-addressing table before that.
+ *
+ * @param ranks Pointer to the RankTable to search.
+ * @param pair The pair of adjacent token ids.
+ * @return The merged token id, or -1 if the pair was never merged.
+ */
+int lookup_rank(const RankTable *ranks, Pair pair)
+{
+    return lookup_rank_key(ranks, pack_pair(pair));
+}
+
+/**
+ * Applies the merges in `ranks` to a sequence of token ids in place, BPE style: the
+ * adjacent pair with the lowest rank (the one merged earliest during training) is merged
+ * everywhere it occurs, and this repeats until no mergeable pair remains. Each candidate
+ * pair costs a single hash lookup and merging never allocates.
+ *
+ * @param ranks Pointer to the RankTable holding the merges to apply.
+ * @param ids Token ids to merge; overwritten with the merged sequence.
+ * @param length The number of elements in `ids`.
+ * @return The length of the merged sequence.
+ */
+size_t apply_merges(const RankTable *ranks, int *ids, size_t length)
+{
+    while (length >= 2)
+    {
+        PairKey best_key = EMPTY_PAIR_KEY;
+        int best_idx = -1;
+        for (size_t i = 0; i + 1 < length; i++)
+        {
+            PairKey key = pair_key(ids[i], ids[i + 1]);
+            int idx = lookup_rank_key(ranks, key);
+            if (idx >= 0 && (best_idx < 0 || idx < best_idx))
+            {
+                best_key = key;
+                best_idx = idx;
+            }
+        }
+        if (best_idx < 0)
+        {
+            break; // Nothing left to merge
+        }
+        length = merge_in_place(ids, length, unpack_pair(best_key), best_idx);
+    }
+    return length;
+}
+
+#define NO_POSITION UINT32_MAX // End marker of the linked list in apply_merges_linked
+
+/**
+ * Packs a pending merge of rank `idx` at `position` so that comparing packed values orders
+ * candidates by rank and then left to right, the order apply_merges merges them in.
+ */
+uint64_t merge_candidate(int idx, uint32_t position)
+{
+    return (uint64_t)idx << 32 | position;
+}
+
+/**
+ * Restores the min-heap property of `heap` below `i`.
+ */
+void sift_down_candidates(uint64_t *heap, size_t size, size_t i)
+{
+    uint64_t value = heap[i];
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+        if (child >= size)
+        {
+            break;
+        }
+        if (child + 1 < size && heap[child + 1] < heap[child])
+        {
+            child++;
+        }
+        if (heap[child] >= value)
+        {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = value;
+}
+
+/**
+ * Adds the pair starting at `position` to `heap` if `ranks` has a merge for it.
+ */
+void push_merge_candidate(const RankTable *ranks, const int *ids, const uint32_t *next, uint32_t position,
+                          uint64_t *heap, size_t *size)
+{
+    int idx = lookup_rank_key(ranks, pair_key(ids[position], ids[next[position]]));
+    if (idx < 0)
+    {
+        return;
+    }
+    size_t i = (*size)++;
+    uint64_t value = merge_candidate(idx, position);
+    while (i > 0 && heap[(i - 1) / 2] > value)
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = value;
+}
+
+/**
+ * Orders wide merge candidates as merge_candidate orders packed ones: by rank, then left
+ * to right.
+ */
+int wide_candidate_before(WideMergeCandidate a, WideMergeCandidate b)
+{
+    return a.idx != b.idx ? a.idx < b.idx : a.position < b.position;
+}
+
+/**
+ * Adds the pair starting at `position` to a heap of wide candidates if `ranks` has a merge
+ * for it.
+ */
+void push_wide_merge_candidate(const RankTable *ranks, const int *ids, const size_t *next, size_t position,
+                               WideMergeCandidate *heap, size_t *size)
+{
+    int idx = lookup_rank_key(ranks, pair_key(ids[position], ids[next[position]]));
+    if (idx < 0)
+    {
+        return;
+    }
+    size_t i = (*size)++;
+    WideMergeCandidate value = {idx, position};
+    while (i > 0 && wide_candidate_before(value, heap[(i - 1) / 2]))
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = value;
+}
+
+/**
+ * apply_merges_linked for sequences of NO_POSITION ids or more: the same algorithm with
+ * 64-bit links and candidates, which take about 64 bytes of scratch memory per id.
+ *
+ * @return The length of the merged sequence.
+ */
+size_t apply_merges_linked_wide(const RankTable *ranks, int *ids, size_t length, Allocator allocator)
+{
+    if (length < 2)
+    {
+        return length;
+    }
+    Arena scratch;
+    init_arena(&scratch, allocator);
+    size_t *prev = arena_alloc(&scratch, MEMORY_IDS, length * sizeof(size_t));
+    size_t *next = arena_alloc(&scratch, MEMORY_IDS, length * sizeof(size_t));
+    WideMergeCandidate *heap = arena_alloc(&scratch, MEMORY_IDS, 2 * length * sizeof(WideMergeCandidate));
+    if (prev == NULL || next == NULL || heap == NULL)
+    {
+        arena_release(&scratch);
+        return apply_merges(ranks, ids, length); // Same result without scratch memory, only slower
+    }
+    size_t heap_size = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        prev[i] = i > 0 ? i - 1 : SIZE_MAX;
+        next[i] = i + 1 < length ? i + 1 : SIZE_MAX;
+    }
+    for (size_t i = 0; i + 1 < length; i++)
+    {
+        push_wide_merge_candidate(ranks, ids, next, i, heap, &heap_size);
+    }
+
+    while (heap_size > 0)
+    {
+        WideMergeCandidate top = heap[0];
+        WideMergeCandidate last = heap[--heap_size];
+        size_t i = 0;
+        for (;;)
+        {
+            size_t child = 2 * i + 1;
+            if (child >= heap_size)
+            {
+                break;
+            }
+            if (child + 1 < heap_size && wide_candidate_before(heap[child + 1], heap[child]))
+            {
+                child++;
+            }
+            if (!wide_candidate_before(heap[child], last))
+            {
+                break;
+            }
+            heap[i] = heap[child];
+            i = child;
+        }
+        heap[i] = last;
+
+        size_t position = top.position;
+        size_t second = next[position];
+        if (ids[position] < 0 || second == SIZE_MAX ||
+            lookup_rank_key(ranks, pair_key(ids[position], ids[second])) != top.idx)
+        {
+            continue; // Merged away or changed since it was queued
+        }
+        ids[position] = top.idx;
+        ids[second] = -1;
+        next[position] = next[second];
+        if (next[position] != SIZE_MAX)
+        {
+            prev[next[position]] = position;
+            push_wide_merge_candidate(ranks, ids, next, position, heap, &heap_size);
+        }
+        if (prev[position] != SIZE_MAX)
+        {
+            push_wide_merge_candidate(ranks, ids, next, prev[position], heap, &heap_size);
+        }
+    }
+
+    size_t new_length = 0;
+    for (size_t i = 0; i != SIZE_MAX; i = next[i])
+    {
+        ids[new_length++] = ids[i];
+    }
+    arena_release(&scratch);
+    return new_length;
+}
+
+/**
+ * Merges `ids` to exactly what apply_merges produces, in O(n log n) time rather than one
+ * full scan per distinct merge applied, which is what re-encoding a whole corpus with
+ * tens of thousands of merges needs. The ids are threaded on a linked list and every
+ * mergeable pair waits in a min-heap ordered by rank and position; a merge unlinks one
+ * id and looks up only the two pairs it creates. Candidates whose pair has changed since
+ * they were queued are skipped when they surface.
+ *
+ * Scratch memory is about 24 bytes per id, taken from `allocator` and released before
+ * returning; if the allocator fails, the ids are merged by apply_merges instead. Sequences
+ * too long for 32-bit positions go to apply_merges_linked_wide.
+ *
+ * @return The length of the merged sequence.
+ */
+size_t apply_merges_linked(const RankTable *ranks, int *ids, size_t length, Allocator allocator)
+{
+    if (length >= NO_POSITION)
+    {
+        return apply_merges_linked_wide(ranks, ids, length, allocator);
+    }
+    if (length < 2)
+    {
+        return length;
+    }
+    Arena scratch;
+    init_arena(&scratch, allocator);
+    uint32_t *prev = arena_alloc(&scratch, MEMORY_IDS, length * sizeof(uint32_t));
+    uint32_t *next = arena_alloc(&scratch, MEMORY_IDS, length * sizeof(uint32_t));
+    uint64_t *heap = arena_alloc(&scratch, MEMORY_IDS, 2 * length * sizeof(uint64_t)); // Each merge nets one entry at most
+    if (prev == NULL || next == NULL || heap == NULL)
+    {
+        arena_release(&scratch);
+        return apply_merges(ranks, ids, length); // Same result without scratch memory, only slower
+    }
+    size_t heap_size = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        prev[i] = i > 0 ? i - 1 : NO_POSITION;
+        next[i] = i + 1 < length ? i + 1 : NO_POSITION;
+    }
+    for (size_t i = 0; i + 1 < length; i++)
+    {
+        push_merge_candidate(ranks, ids, next, i, heap, &heap_size);
+    }
+
+    while (heap_size > 0)
+    {
+        uint64_t top = heap[0];
+        heap[0] = heap[--heap_size];
+        sift_down_candidates(heap, heap_size, 0);
+        uint32_t position = (uint32_t)top;
+        int idx = (int)(top >> 32);
+        uint32_t second = next[position];
+        if (ids[position] < 0 || second == NO_POSITION ||
+            lookup_rank_key(ranks, pair_key(ids[position], ids[second])) != idx)
+        {
+            continue; // Merged away or changed since it was queued
+        }
+        ids[position] = idx;
+        ids[second] = -1;
+        next[position] = next[second];
+        if (next[position] != NO_POSITION)
+        {
+            prev[next[position]] = position;
+            push_merge_candidate(ranks, ids, next, position, heap, &heap_size);
+        }
+        if (prev[position] != NO_POSITION)
+        {
+            push_merge_candidate(ranks, ids, next, prev[position], heap, &heap_size);
+        }
+    }
+
+    size_t new_length = 0;
+    for (uint32_t i = 0; i != NO_POSITION; i = next[i])
+    {
+        ids[new_length++] = ids[i];
+    }
+    arena_release(&scratch);
+    return new_length;
+}
+
+/**
+ * Creates and initializes a new BasicTokenizer instance whose memory comes from the given
+ * allocator. The tokenizer owns an Arena on top of that allocator from which its
+ * vocabulary, merges and rank table are carved; arrays grow geometrically inside the
+ * arena, and cleanup_tokenizer hands every block back to the allocator in one sweep.
+ * Creating and destroying many tokenizers therefore costs only a handful of allocator
+ * calls each, which keeps contention low when tokenizers are churned across threads.
+ *
+ * The vocabulary is initialized with INITIAL_VOCAB_SIZE tokens where each token is a
+ * single byte value, and the merges structure starts empty.
+ *
+ * @param allocator The allocator used for the tokenizer struct and all of its tables.
+ * @return Pointer to the newly created BasicTokenizer structure, or NULL if the allocator fails.
+ *
+ * Example usage:
+ * Allocator allocator = {my_pool_alloc, my_pool_free, my_pool};
+ * BasicTokenizer* tokenizer = create_basic_tokenizer_with_allocator(allocator);
+ */
+BasicTokenizer *create_basic_tokenizer_with_allocator(Allocator allocator)
+{
+    BasicTokenizer *tokenizer = allocator.allocate(allocator.context, sizeof(BasicTokenizer));
+    if (tokenizer == NULL)
+    {
+        return NULL;
+    }
+    account_memory(MEMORY_OTHER, sizeof(BasicTokenizer));
+    account_memory(MEMORY_TOTAL, sizeof(BasicTokenizer));
+    memset(tokenizer, 0, sizeof(BasicTokenizer));
+    init_arena(&tokenizer->arena, allocator);
+    tokenizer->vocab_capacity = INITIAL_VOCAB_SIZE;
+    tokenizer->vocab_bytes_capacity = INITIAL_VOCAB_SIZE;
+    tokenizer->vocab = arena_alloc(&tokenizer->arena, MEMORY_VOCAB, INITIAL_VOCAB_SIZE);
+    tokenizer->vocab_offsets = arena_alloc(&tokenizer->arena, MEMORY_VOCAB, (INITIAL_VOCAB_SIZE + 1) * sizeof(int));
+    for (int i = 0; i < INITIAL_VOCAB_SIZE; i++)
+    {
+        tokenizer->vocab[i] = i;
+        tokenizer->vocab_offsets[i] = i;
+    }
+    tokenizer->vocab_offsets[INITIAL_VOCAB_SIZE] = INITIAL_VOCAB_SIZE;
+    tokenizer->vocab_size = INITIAL_VOCAB_SIZE;
+    tokenizer->byte_ids = arena_alloc(&tokenizer->arena, MEMORY_VOCAB, 256 * sizeof(int));
+    for (int i = 0; i < 256; i++)
+    {
+        tokenizer->byte_ids[i] = i;
+    }
+    memset(&tokenizer->merges, 0, sizeof(tokenizer->merges));
+    tokenizer->merges.arena = &tokenizer->arena;
+    tokenizer->ranks.entries = NULL;
+    tokenizer->ranks.capacity = 0;
+    tokenizer->mapping = NULL;
+    tokenizer->mapping_size = 0;
+    tokenizer->embedded = 0;
+    return tokenizer;
+}
+
+/**
+ * Creates and initializes a new BasicTokenizer instance backed by the current allocator
+ * (malloc and free unless set_allocator was called). See
+ * create_basic_tokenizer_with_allocator for how its memory is organized.
+ *
+ * @return Pointer to the newly created BasicTokenizer structure.
+ *
+ * Example usage:
+ * BasicTokenizer* tokenizer = create_basic_tokenizer();
+ * // `tokenizer` can now be used for tokenization tasks.
+ */
+BasicTokenizer *create_basic_tokenizer()
+{
+    return create_basic_tokenizer_with_allocator(current_allocator);
+}
+
+void cleanup_tokenizer(BasicTokenizer *tokenizer)
+{
+    // An embedded tokenizer is static data and owns nothing
+    if (tokenizer->embedded)
+    {
+        return;
+    }
+
+    // A loaded model owns nothing but its mapping
+    if (tokenizer->mapping != NULL)
+    {
+        munmap(tokenizer->mapping, tokenizer->mapping_size);
+        basic_free(tokenizer);
+        return;
+    }
+
+    // Vocabulary, merges and rank table all live in the arena
+    Allocator allocator = tokenizer->arena.allocator;
+    arena_release(&tokenizer->arena);
+
+    // Finally, free the tokenizer structure
+    account_memory(MEMORY_OTHER, -(long long)sizeof(BasicTokenizer));
+    account_memory(MEMORY_TOTAL, -(long long)sizeof(BasicTokenizer));
+    allocator.release(allocator.context, tokenizer, sizeof(BasicTokenizer));
+}
+
+/**
+ * Appends a new token to the end of the tokenizer's vocabulary. The token's bytes are
+ * formed by concatenating the bytes of the two tokens in `pair`, which is how every
+ * merged token is defined in BPE: decoding the new id must yield exactly what decoding
+ * `pair.first` followed by `pair.second` would.
+ *
+ * Both the byte arena and the offsets array grow geometrically inside the tokenizer's
+ * Arena, so appending is amortized constant time, and the length of every token stays
+ * available as `vocab_offsets[id + 1] - vocab_offsets[id]` without scanning.
+ *
+ * @param tokenizer Pointer to the BasicTokenizer whose vocabulary is extended.
+ * @param pair The pair of existing token ids whose bytes make up the new token.
+ */
+void append_merged_token(BasicTokenizer *tokenizer, Pair pair)
+{
+    int *offsets = tokenizer->vocab_offsets;
+    int first_length = offsets[pair.first + 1] - offsets[pair.first];
+    int second_length = offsets[pair.second + 1] - offsets[pair.second];
+    int end = offsets[tokenizer->vocab_size];
+
+    if (end + first_length + second_length > tokenizer->vocab_bytes_capacity)
+    {
+        int capacity = tokenizer->vocab_bytes_capacity * 2;
+        while (capacity < end + first_length + second_length)
+        {
+            capacity *= 2;
+        }
+        tokenizer->vocab = arena_grow(&tokenizer->arena, MEMORY_VOCAB, tokenizer->vocab, tokenizer->vocab_bytes_capacity, capacity);
+        tokenizer->vocab_bytes_capacity = capacity;
+    }
+    if (tokenizer->vocab_size + 1 > tokenizer->vocab_capacity)
+    {
+        int capacity = tokenizer->vocab_capacity * 2;
+        tokenizer->vocab_offsets = arena_grow(&tokenizer->arena, MEMORY_VOCAB, tokenizer->vocab_offsets,
+                                              (tokenizer->vocab_capacity + 1) * sizeof(int), (capacity + 1) * sizeof(int));
+        tokenizer->vocab_capacity = capacity;
+    }
+    offsets = tokenizer->vocab_offsets;
+
+    memcpy(tokenizer->vocab + end, tokenizer->vocab + offsets[pair.first], first_length);
+    memcpy(tokenizer->vocab + end + first_length, tokenizer->vocab + offsets[pair.second], second_length);
+    tokenizer->vocab_size++;
+    offsets[tokenizer->vocab_size] = end + first_length + second_length;
+}
+
+/**
+ * Rounds `offset` up to the next multiple of MODEL_ALIGNMENT.
+ */
+uint64_t align_model_offset(uint64_t offset)
+{
+    return (offset + MODEL_ALIGNMENT - 1) & ~(uint64_t)(MODEL_ALIGNMENT - 1);
+}
+
+/**
+ * Writes `size` bytes of `data` at `offset` in `file`, zero-filling any gap between the
+ * current end of the file and `offset`. Returns 0 on success and -1 on a write error.
+ */
+int write_model_section(FILE *file, uint64_t offset, const void *data, size_t size)
+{
+    static const unsigned char zeros[MODEL_ALIGNMENT] = {0};
+    long position = ftell(file);
+    if (position < 0 || (uint64_t)position > offset || offset - position > MODEL_ALIGNMENT)
+    {
+        return -1;
+    }
+    if (fwrite(zeros, 1, offset - position, file) != offset - position)
+    {
+        return -1;
+    }
+    return size == 0 || fwrite(data, 1, size, file) == size ? 0 : -1;
+}
+
+/**
+ * Saves a tokenizer to a binary model file that load_model can map directly into memory.
+ *
+ * The file consists of a fixed ModelHeader followed by the merges (pairs and their ids),
+ * the vocabulary offsets, the vocabulary byte arena, the precomputed rank table, the
+ * byte id map, the dense byte-pair rank table and the perfect hash built by
+ * freeze_merges (seeds and slots). Each
+ * section is the verbatim image of the in-memory array, aligned to MODEL_ALIGNMENT bytes,
+ * so that loading never parses or copies anything. The format is native-endian; the
+ * header records the byte order and version so that incompatible files are rejected.
+ *
+ * @param tokenizer Pointer to the (typically trained) BasicTokenizer to save.
+ * @param path Path of the model file to create or overwrite.
+ * @return 0 on success, -1 if the file could not be written.
+ *
+ * Example usage:
+ * train(tokenizer, text, 1000, 0);
+ * save_model(tokenizer, "tokenizer.bin");
+ */
+int save_model(BasicTokenizer *tokenizer, const char *path)
+{
+    if (tokenizer->mapping == NULL && !tokenizer->embedded)
+    {
+        if (tokenizer->ranks.entries == NULL)
+        {
+            build_rank_table(tokenizer);
+        }
+        if (tokenizer->ranks.perfect.slots == NULL)
+        {
+            freeze_merges(tokenizer);
+        }
+    }
+
+    ModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+    header.version = MODEL_VERSION;
+    header.byte_order = MODEL_BYTE_ORDER;
+    header.vocab_size = tokenizer->vocab_size;
+    header.num_merges = tokenizer->merges.size;
+    header.rank_capacity = tokenizer->ranks.capacity;
+    header.vocab_bytes = tokenizer->vocab_offsets[tokenizer->vocab_size];
+
+    size_t pairs_size = (size_t)header.num_merges * sizeof(PairKey);
+    size_t ids_size = (size_t)header.num_merges * sizeof(int32_t);
+    size_t offsets_size = (size_t)(header.vocab_size + 1) * sizeof(int32_t);
+    size_t ranks_size = (size_t)header.rank_capacity * sizeof(RankEntry);
+    size_t byte_ids_size = 256 * sizeof(int32_t);
+    size_t byte_pairs_size = BYTE_PAIR_TABLE_SIZE * sizeof(int32_t);
+    header.merge_pairs_offset = align_model_offset(sizeof(ModelHeader));
+    header.merge_ids_offset = align_model_offset(header.merge_pairs_offset + pairs_size);
+    header.vocab_offsets_offset = align_model_offset(header.merge_ids_offset + ids_size);
+    header.vocab_offset = align_model_offset(header.vocab_offsets_offset + offsets_size);
+    header.ranks_offset = align_model_offset(header.vocab_offset + header.vocab_bytes);
+    header.byte_ids_offset = align_model_offset(header.ranks_offset + ranks_size);
+    header.byte_pair_ranks_offset = align_model_offset(header.byte_ids_offset + byte_ids_size);
+    header.perfect_buckets = tokenizer->ranks.perfect.num_buckets;
+    header.perfect_slots = tokenizer->ranks.perfect.num_slots;
+    size_t seeds_size = (size_t)header.perfect_buckets * sizeof(uint32_t);
+    size_t perfect_slots_size = (size_t)header.perfect_slots * sizeof(RankEntry);
+    header.perfect_seeds_offset = align_model_offset(header.byte_pair_ranks_offset + byte_pairs_size);
+    header.perfect_slots_offset = align_model_offset(header.perfect_seeds_offset + seeds_size);
+    header.file_size = header.perfect_slots_offset + perfect_slots_size;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: cannot open %s for writing.\n", path);
+        return -1;
+    }
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1;
+    failed = failed || write_model_section(file, header.merge_pairs_offset, tokenizer->merges.keys, pairs_size);
+    failed = failed || write_model_section(file, header.merge_ids_offset, tokenizer->merges.ids, ids_size);
+    failed = failed || write_model_section(file, header.vocab_offsets_offset, tokenizer->vocab_offsets, offsets_size);
+    failed = failed || write_model_section(file, header.vocab_offset, tokenizer->vocab, header.vocab_bytes);
+    failed = failed || write_model_section(file, header.ranks_offset, tokenizer->ranks.entries, ranks_size);
+    failed = failed || write_model_section(file, header.byte_ids_offset, tokenizer->byte_ids, byte_ids_size);
+    failed = failed || write_model_section(file, header.byte_pair_ranks_offset, tokenizer->ranks.byte_pairs, byte_pairs_size);
+    failed = failed || write_model_section(file, header.perfect_seeds_offset, tokenizer->ranks.perfect.seeds, seeds_size);
+    failed = failed || write_model_section(file, header.perfect_slots_offset, tokenizer->ranks.perfect.slots, perfect_slots_size);
+    failed = fclose(file) != 0 || failed;
+    if (failed)
+    {
+        fprintf(stderr, "Error: failed to write model file %s.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Checks that a section of `size` bytes at `offset` lies inside a model file of
+ * `file_size` bytes and is suitably aligned for direct use.
+ */
+int model_section_valid(uint64_t offset, uint64_t size, uint64_t file_size)
+{
+    return offset % MODEL_ALIGNMENT == 0 && offset <= file_size && size <= file_size - offset;
+}
+
+/**
+ * Loads a tokenizer from a model file written by save_model by mapping it read-only into
+ * memory. The returned tokenizer's merges, vocabulary and rank table point straight into
+ * the mapping: nothing is parsed, copied or allocated besides the BasicTokenizer struct
+ * itself, so loading takes constant time regardless of vocabulary size, and the pages
+ * are shared by every process that maps the same file.
+ *
+ * Only the header is validated; section contents are trusted as written by save_model.
+ * A mapped tokenizer is read-only: it can encode and decode but not be trained. Release
+ * it with cleanup_tokenizer, which unmaps the file.
+ *
+ * @param path Path of the model file to load.
+ * @return Pointer to the loaded BasicTokenizer, or NULL if the file is missing or invalid.
+ *
+ * Example usage:
+ * BasicTokenizer *tokenizer = load_model("tokenizer.bin");
+ * int length;
+ * int *ids = encode(tokenizer, text, &length);
+ */
+BasicTokenizer *load_model(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: cannot open model file %s.\n", path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ModelHeader))
+    {
+        fprintf(stderr, "Error: %s is not a model file.\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: cannot map model file %s.\n", path);
+        return NULL;
+    }
+
+    const ModelHeader *header = mapping;
+    unsigned char *base = mapping;
+    int valid = memcmp(header->magic, MODEL_MAGIC, sizeof(header->magic)) == 0 &&
+                header->version == MODEL_VERSION &&
+                header->byte_order == MODEL_BYTE_ORDER &&
+                header->file_size == size &&
+                header->vocab_size > 0 && header->num_merges >= 0 && header->vocab_bytes >= 0 &&
+                header->rank_capacity > 0 && (header->rank_capacity & (header->rank_capacity - 1)) == 0 &&
+                model_section_valid(header->merge_pairs_offset, (uint64_t)header->num_merges * sizeof(PairKey), size) &&
+                model_section_valid(header->merge_ids_offset, (uint64_t)header->num_merges * sizeof(int32_t), size) &&
+                model_section_valid(header->vocab_offsets_offset, (uint64_t)(header->vocab_size + 1) * sizeof(int32_t), size) &&
+                model_section_valid(header->vocab_offset, header->vocab_bytes, size) &&
+                model_section_valid(header->ranks_offset, (uint64_t)header->rank_capacity * sizeof(RankEntry), size) &&
+                model_section_valid(header->byte_ids_offset, 256 * sizeof(int32_t), size) &&
+                model_section_valid(header->byte_pair_ranks_offset, BYTE_PAIR_TABLE_SIZE * sizeof(int32_t), size) &&
+                header->perfect_buckets >= 0 && header->perfect_slots >= 0 &&
+                model_section_valid(header->perfect_seeds_offset, (uint64_t)header->perfect_buckets * sizeof(uint32_t), size) &&
+                model_section_valid(header->perfect_slots_offset, (uint64_t)header->perfect_slots * sizeof(RankEntry), size);
+    if (!valid)
+    {
+        fprintf(stderr, "Error: %s is not a compatible model file (expected version %d).\n", path, MODEL_VERSION);
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    BasicTokenizer *tokenizer = basic_alloc(MEMORY_OTHER, sizeof(BasicTokenizer));
+    memset(tokenizer, 0, sizeof(BasicTokenizer));
+    tokenizer->vocab = base + header->vocab_offset;
+    tokenizer->vocab_offsets = (int *)(base + header->vocab_offsets_offset);
+    tokenizer->vocab_size = header->vocab_size;
+    tokenizer->byte_ids = (int *)(base + header->byte_ids_offset);
+    tokenizer->merges.keys = (PairKey *)(base + header->merge_pairs_offset);
+    tokenizer->merges.ids = (int32_t *)(base + header->merge_ids_offset);
+    tokenizer->merges.size = header->num_merges;
+    tokenizer->merges.capacity = header->num_merges;
+    tokenizer->ranks.entries = (RankEntry *)(base + header->ranks_offset);
+    tokenizer->ranks.capacity = header->rank_capacity;
+    tokenizer->ranks.byte_pairs = (int *)(base + header->byte_pair_ranks_offset);
+    if (header->perfect_slots > 0)
+    {
+        tokenizer->ranks.perfect.seeds = (uint32_t *)(base + header->perfect_seeds_offset);
+        tokenizer->ranks.perfect.slots = (RankEntry *)(base + header->perfect_slots_offset);
+    }
+    tokenizer->ranks.perfect.num_buckets = header->perfect_buckets;
+    tokenizer->ranks.perfect.num_slots = header->perfect_slots;
+    tokenizer->mapping = mapping;
+    tokenizer->mapping_size = size;
+    tokenizer->embedded = 0;
+    return tokenizer;
+}
+
+/**
+ * Sizes a count-min sketch for sequences of up to `length` ids within about `bytes` of
+ * memory from `arena`; a sketch wider than the number of pairs would not be any sharper.
+ */
+void init_count_min_sketch(Arena *arena, CountMinSketch *sketch, size_t bytes, size_t length, int64_t min_count,
+                           int64_t floor)
+{
+    int width = 1024;
+    while ((size_t)width * 2 * SKETCH_DEPTH * sizeof(uint32_t) <= bytes && (size_t)width < length && width < (1 << 30))
+    {
+        width *= 2;
+    }
+    sketch->cells = arena_alloc(arena, MEMORY_PAIR_COUNTS, (size_t)width * SKETCH_DEPTH * sizeof(uint32_t));
+    sketch->width = width;
+    sketch->floor = floor > 1 ? floor : 1;
+    sketch->min_count = min_count > sketch->floor ? min_count : sketch->floor;
+    sketch->last_max = 0;
+}
+
+/**
+ * Finds the counter of `key` in each row of the sketch. The rows are interleaved in
+ * 64-byte blocks of four counters per row, and all of a key's counters lie in one block,
+ * so an update or estimate touches a single cache line instead of one per row.
+ */
+void sketch_cells(const CountMinSketch *sketch, PairKey key, uint32_t **cells)
+{
+    uint64_t hash = mix64(key);
+    uint32_t *block = &sketch->cells[(hash & (sketch->width / 4 - 1)) * 4 * SKETCH_DEPTH];
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        cells[row] = &block[row * 4 + ((hash >> (32 + 2 * row)) & 3)];
+    }
+}
+
+/**
+ * Counts one occurrence of `key`. Conservative update: only the counters holding the
+ * current minimum are raised, which keeps overestimates far smaller than raising all.
+ */
+void sketch_add(CountMinSketch *sketch, PairKey key)
+{
+    uint32_t *cells[SKETCH_DEPTH];
+    sketch_cells(sketch, key, cells);
+    uint32_t estimate = UINT32_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        estimate = *cells[row] < estimate ? *cells[row] : estimate;
+    }
+    if (estimate == UINT32_MAX)
+    {
+        return; // Saturated
+    }
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        if (*cells[row] == estimate)
+        {
+            (*cells[row])++;
+        }
+    }
+}
+
+/**
+ * Returns an upper bound on the number of times `key` was added.
+ */
+int64_t sketch_estimate(const CountMinSketch *sketch, PairKey key)
+{
+    uint32_t *cells[SKETCH_DEPTH];
+    sketch_cells(sketch, key, cells);
+    uint32_t estimate = UINT32_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        estimate = *cells[row] < estimate ? *cells[row] : estimate;
+    }
+    return estimate;
+}
+
+/**
+ * Counts the pairs of `ids` into `counts` in two passes, tabling only the frequent ones.
+ * The first pass feeds every pair to `sketch`; the second counts exactly, in order of
+ * first occurrence, just the pairs whose estimate reaches a threshold. The table then
+ * holds a few pairs above the threshold instead of every distinct pair, which bounds its
+ * memory on diverse input such as code or multilingual text.
+ *
+ * Estimates never fall short, so every pair at or above the threshold is tabled with its
+ * exact count, and as long as the most frequent pair reaches the threshold, training picks
+ * the same merge as with the full table. The threshold is half the previous pass's
+ * highest count (at least `sketch->min_count`). If the highest tabled count then falls
+ * short of it, the second pass is repeated with the threshold halved (or lower, to the
+ * highest estimate it left out), but no lower than that count: a threshold at or below it
+ * is sure to include the most frequent pair.
+ * No threshold goes below `sketch->floor`, so with a
+ * minimum frequency set only pairs that may reach it are tabled. Batched training (merges_per_pass above 1) draws
+ * its batches from the tabled pairs only, so its merges can differ from the hash engine's.
+ *
+ * Byte pairs always go to the dense byte-pair table, whose size is fixed anyway. The two
+ * passes make this engine slower than the hash engine while the full table would fit in
+ * cache; it pays off in memory once it would not.
+ */
+void get_stats_sketched(PairCounts *counts, int *ids, size_t length, CountMinSketch *sketch)
+{
+    memset(sketch->cells, 0, (size_t)sketch->width * SKETCH_DEPTH * sizeof(uint32_t));
+    for (size_t i = 0; i + 1 < length; i++)
+    {
+        PairKey key = pair_key(ids[i], ids[i + 1]);
+        if (!is_byte_pair(key))
+        {
+            sketch_add(sketch, key);
+        }
+    }
+
+    int64_t threshold = sketch->last_max / 2 > sketch->min_count ? sketch->last_max / 2 : sketch->min_count;
+    for (;;)
+    {
+        clear_pair_counts(counts);
+        enable_byte_pair_table(counts);
+        int64_t highest_untabled = 0; // Highest estimate left below the threshold
+        for (size_t i = 0; i + 1 < length; i++)
+        {
+            PairKey key = pair_key(ids[i], ids[i + 1]);
+            int *slot = pair_slot(counts, key);
+            if (*slot != 0)
+            {
+                counts->counts[*slot - 1]++;
+                continue;
+            }
+            int64_t estimate = is_byte_pair(key) ? threshold : sketch_estimate(sketch, key);
+            if (estimate >= threshold)
+            {
+                insert_pair_key(counts, key, slot, 1);
+            }
+            else
+            {
+                highest_untabled = estimate > highest_untabled ? estimate : highest_untabled;
+            }
+        }
+        int64_t max_count = counts->size > 0 ? counts->counts[argmax_counts(counts->counts, counts->size)] : 0;
+        if (max_count >= threshold || threshold == sketch->floor)
+        {
+            sketch->last_max = max_count;
+            return;
+        }
+        // Halve rather than drop straight to max_count, which may be tiny and table almost
+        // every pair; a threshold at or below max_count is sure to be the last retry. No
+        // estimate lies between highest_untabled and the threshold, so go no higher.
+        int64_t lowered = threshold / 2 < highest_untabled ? threshold / 2 : highest_untabled;
+        lowered = lowered > max_count ? lowered : max_count;
+        threshold = lowered > sketch->floor ? lowered : sketch->floor;
+    }
+}
+
+/**
+ * Counts the pairs of `ids` into `stats` with the stats engine selected in `options`. The
+ * hash and sort engines skip the pairs `live` shows to be dead; the sketch engine has its
+ * own floor.
+ */
+void count_pairs(PairCounts *stats, int *ids, size_t length, const TrainOptions *options, SortStatsBuffers *sort_buffers,
+                 CountMinSketch *sketch, LivePairs *live)
+{
+    if (options->stats_engine == STATS_ENGINE_SORT)
+    {
+        get_stats_sorted(stats, ids, length, sort_buffers, options->num_threads, live);
+    }
+    else if (options->stats_engine == STATS_ENGINE_SKETCH)
+    {
+        get_stats_sketched(stats, ids, length, sketch);
+    }
+    else
+    {
+        get_live_stats_into(stats, ids, length, live);
+    }
+}
+
+/**
+ * Records `pair`, seen `count` times, as the tokenizer's next merge and adds the merged
+ * token to the vocabulary. The caller still has to merge the pair in its own token
+ * sequences.
+ *
+ * @return The id of the new token.
+ */
+int record_merge(BasicTokenizer *tokenizer, Pair pair, int64_t count, int step, int num_merges, int verbose)
+{
+    int new_idx = tokenizer->vocab_size;
+    append_merge(&tokenizer->merges, pair, new_idx);
+    append_merged_token(tokenizer, pair);
+    if (verbose)
+    {
+        printf("merge %d/%d: (%d, %d) -> %d had %lld occurrences\n", step + 1, num_merges, pair.first, pair.second,
+               new_idx, (long long)count);
+    }
+    return new_idx;
+}
+
+/**
+ * Allocates the bookkeeping for batches of up to `max_size` merges over token ids below
+ * `vocab_size` from `arena`.
+ */
+void init_merge_batch(MergeBatch *batch, Arena *arena, int max_size, int vocab_size)
+{
+    batch->pairs = arena_alloc(arena, MEMORY_OTHER, max_size * sizeof(Pair));
+    batch->merged = arena_alloc(arena, MEMORY_OTHER, max_size * sizeof(int));
+    batch->size = 0;
+    batch->batch_of = arena_alloc(arena, MEMORY_OTHER, vocab_size * sizeof(int));
+    memset(batch->batch_of, 0xFF, vocab_size * sizeof(int));
+    batch->in_batch = arena_alloc(arena, MEMORY_OTHER, vocab_size);
+    memset(batch->in_batch, 0, vocab_size);
+    batch->order = NULL;
+    batch->order_capacity = 0;
+}
+
+/**
+ * qsort comparator putting the most frequent pairs first and, among equals, the one seen
+ * first.
+ */
+int compare_ranked_pairs(const void *a, const void *b)
+{
+    const RankedPair *x = a;
+    const RankedPair *y = b;
+    if (x->count != y->count)
+    {
+        return x->count > y->count ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+/**
+ * Restores the heap property of `heap` below `i`, for a heap whose root is the candidate
+ * that sorts last under compare_ranked_pairs.
+ */
+void sift_down_ranked_pairs(RankedPair *heap, int size, int i)
+{
+    RankedPair value = heap[i];
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= size)
+        {
+            break;
+        }
+        if (child + 1 < size && compare_ranked_pairs(&heap[child + 1], &heap[child]) > 0)
+        {
+            child++;
+        }
+        if (compare_ranked_pairs(&heap[child], &value) <= 0)
+        {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = value;
+}
+
+/**
+ * Fills `order` with the `k` pairs of `stats` that compare_ranked_pairs puts first, sorted
+ * in that order. A heap of the best `k` seen so far, rooted at the worst of them, makes
+ * this O(n log k) rather than sorting all n pairs.
+ */
+void select_top_pairs(const PairCounts *stats, RankedPair *order, int k)
+{
+    for (int i = 0; i < k; i++)
+    {
+        order[i].count = stats->counts[i];
+        order[i].index = i;
+    }
+    for (int i = k / 2 - 1; i >= 0; i--)
+    {
+        sift_down_ranked_pairs(order, k, i);
+    }
+    for (int i = k; i < stats->size; i++)
+    {
+        RankedPair candidate = {stats->counts[i], i};
+        if (compare_ranked_pairs(&candidate, &order[0]) < 0)
+        {
+            order[0] = candidate;
+            sift_down_ranked_pairs(order, k, 0);
+        }
+    }
+    qsort(order, k, sizeof(RankedPair), compare_ranked_pairs);
+}
+
+/**
+ * Empties `batch`, clearing the marks its merges left in batch_of and in_batch.
+ */
+void reset_merge_batch(MergeBatch *batch)
+{
+    for (int b = 0; b < batch->size; b++)
+    {
+        batch->batch_of[batch->pairs[b].first] = -1;
+        batch->in_batch[batch->pairs[b].first] = 0;
+        batch->in_batch[batch->pairs[b].second] = 0;
+    }
+    batch->size = 0;
+}
+
+/**
+ * Adds the merge of `pair` into `merged` to `batch`, which must not use either token yet.
+ */
+void add_merge_to_batch(MergeBatch *batch, Pair pair, int merged)
+{
+    batch->in_batch[pair.first] = 1;
+    batch->in_batch[pair.second] = 1;
+    batch->batch_of[pair.first] = batch->size;
+    batch->pairs[batch->size] = pair;
+    batch->merged[batch->size] = merged;
+    batch->size++;
+}
+
+/**
+ * Chooses up to `max_merges` pairs from `stats` for one pass and records them as the
+ * tokenizer's next merges. A single merge is the most frequent pair (the first seen on
+ * ties), exactly as in BPE. For more, the pairs are taken in order of count, skipping any
+ * that shares a token with one already chosen. Only the top 2 * `max_merges` candidates are
+ * selected and sorted; when conflicts skip so many that they run out, the selection
+ * doubles and the walk continues where it stopped.
+ *
+ * Disjoint pairs do not change each other's counts, but exact BPE might have picked a
+ * pair created by an earlier merge of the batch instead, so batches only approximate it;
+ * compare_merges measures by how much.
+ *
+ * @return The number of merges chosen, at least 1 if `stats` is not empty.
+ */
+int choose_merges(BasicTokenizer *tokenizer, PairCounts *stats, MergeBatch *batch, int max_merges, int step,
+                  int num_merges, int verbose)
+{
+    reset_merge_batch(batch);
+    if (max_merges <= 1)
+    {
+        int best = argmax_counts(stats->counts, stats->size);
+        Pair pair = unpack_pair(stats->keys[best]);
+        add_merge_to_batch(batch, pair, record_merge(tokenizer, pair, stats->counts[best], step, num_merges, verbose));
+        return 1;
+    }
+
+    // The top candidates of a larger selection start with those of a smaller one, so the
+    // pairs already walked keep their places when the selection grows
+    int walked = 0;
+    int selected = max_merges < stats->size - max_merges ? 2 * max_merges : stats->size;
+    while (batch->size < max_merges && walked < stats->size)
+    {
+        if (selected > batch->order_capacity)
+        {
+            batch->order_capacity = selected;
+            basic_free(batch->order);
+            batch->order = basic_alloc(MEMORY_OTHER, batch->order_capacity * sizeof(RankedPair));
+        }
+        select_top_pairs(stats, batch->order, selected);
+        for (; walked < selected && batch->size < max_merges; walked++)
+        {
+            Pair pair = unpack_pair(stats->keys[batch->order[walked].index]);
+            if (batch->in_batch[pair.first] || batch->in_batch[pair.second])
+            {
+                continue;
+            }
+            add_merge_to_batch(batch, pair, record_merge(tokenizer, pair, batch->order[walked].count,
+                                                         step + batch->size, num_merges, verbose));
+        }
+        selected = selected < stats->size - selected ? 2 * selected : stats->size;
+    }
+    return batch->size;
+}
+
+/**
+ * Merges every pair of `batch` in `ids` in one pass. The pairs share no tokens, so this
+ * is the same as merging them one after another with merge_in_place.
+ *
+ * @return The new length of `ids`.
+ */
+size_t apply_merge_batch(const MergeBatch *batch, int *ids, size_t length)
+{
+    if (batch->size == 1)
+    {
+        return merge_in_place(ids, length, batch->pairs[0], batch->merged[0]);
+    }
+    size_t new_length = 0;
+    size_t i = 0;
+    while (i < length)
+    {
+        int b = batch->batch_of[ids[i]];
+        if (b >= 0 && i + 1 < length && ids[i + 1] == batch->pairs[b].second)
+        {
+            ids[new_length++] = batch->merged[b];
+            i += 2;
+        }
+        else
+        {
+            ids[new_length++] = ids[i++];
+        }
+    }
+    return new_length;
+}
+
+/**
+ * Returns the options train uses: the hash stats engine on one thread, not verbose,
+ * DEFAULT_SHARD_BYTES shards in a temporary file for train_out_of_core, no checkpoints,
+ * one merge per pass, the whole corpus rather than a sample, no minimum pair frequency and
+ * no worker processes.
+ */
+TrainOptions default_train_options()
+{
+    TrainOptions options;
+    options.stats_engine = STATS_ENGINE_HASH;
+    options.num_threads = 1;
+    options.verbose = 0;
+    options.shard_bytes = DEFAULT_SHARD_BYTES;
+    options.scratch_path = NULL;
+    options.checkpoint_path = NULL;
+    options.checkpoint_interval = 0;
+    options.resume = 0;
+    options.merges_per_pass = 1;
+    options.sample_rate = 1.0;
+    options.sample_chunk_bytes = DEFAULT_SAMPLE_CHUNK_BYTES;
+    options.sample_seed = 0;
+    options.refine_merges = 0;
+    options.sketch_bytes = DEFAULT_SKETCH_BYTES;
+    options.sketch_min_count = 2;
+    options.min_frequency = 1;
+    options.num_workers = 1;
+    return options;
+}
+
+/**
+ * Saves the merges learned so far as a model file at `path`. The file is written under a
+ * temporary name and renamed into place, so a crash while writing leaves the previous
+ * checkpoint intact. The rank tables a model file needs are built in a throwaway arena
+ * rather than the tokenizer's, which would otherwise keep every checkpoint's tables until
+ * training ends. A checkpoint is an ordinary model file: load_model can use it as a
+ * partially trained tokenizer.
+ *
+ * @return 0 on success, or -1 if the file could not be written.
+ */
+int write_checkpoint(BasicTokenizer *tokenizer, const char *path)
+{
+    BasicTokenizer snapshot = *tokenizer;
+    init_arena(&snapshot.arena, tokenizer->arena.allocator);
+    memset(&snapshot.ranks, 0, sizeof(snapshot.ranks));
+    build_rank_table(&snapshot);
+    freeze_merges(&snapshot);
+
+    size_t path_length = strlen(path);
+    char *temporary = basic_alloc(MEMORY_OTHER, path_length + sizeof(".tmp"));
+    memcpy(temporary, path, path_length);
+    memcpy(temporary + path_length, ".tmp", sizeof(".tmp"));
+    int result = save_model(&snapshot, temporary);
+    if (result == 0 && rename(temporary, path) != 0)
+    {
+        fprintf(stderr, "Error: cannot move checkpoint %s into place.\n", temporary);
+        remove(temporary);
+        result = -1;
+    }
+    basic_free(temporary);
+    arena_release(&snapshot.arena);
+    return result;
+}
+
+/**
+ * Writes a checkpoint if `options` asks for one between the first `previous` and the first
+ * `done` merges of this training run. Checkpoints are only taken between passes, so a
+ * batched run writes one after the batch that crosses the interval. A failed checkpoint
+ * is reported but does not stop training.
+ */
+void maybe_write_checkpoint(BasicTokenizer *tokenizer, int previous, int done, const TrainOptions *options)
+{
+    if (options->checkpoint_path != NULL && options->checkpoint_interval > 0 &&
+        done / options->checkpoint_interval > previous / options->checkpoint_interval)
+    {
+        write_checkpoint(tokenizer, options->checkpoint_path);
+    }
+}
+
+/**
+ * Restores the merges of the checkpoint at `options->checkpoint_path` into `tokenizer`,
+ * up to `max_merges` of them, when `options->resume` is set and the file exists. A missing
+ * checkpoint means nothing to resume, so the same call can be repeated after a crash
+ * whether or not a checkpoint was written. When training extends a tokenizer, the
+ * checkpoint must start with the tokenizer's own merges and only the ones after them are
+ * restored. The rank table is rebuilt to include them.
+ *
+ * The token sequence is not stored in the checkpoint: training rebuilds it by encoding
+ * the training text with the restored merges, which yields exactly the ids the
+ * interrupted run had.
+ *
+ * @return The number of merges restored, or -1 if the checkpoint cannot be used.
+ */
+int resume_from_checkpoint(BasicTokenizer *tokenizer, int max_merges, const TrainOptions *options)
+{
+    if (!options->resume || options->checkpoint_path == NULL || access(options->checkpoint_path, F_OK) != 0)
+    {
+        return 0;
+    }
+    BasicTokenizer *checkpoint = load_model(options->checkpoint_path);
+    if (checkpoint == NULL)
+    {
+        return -1;
+    }
+    int base = tokenizer->merges.size;
+    int restored = checkpoint->merges.size - base < max_merges ? checkpoint->merges.size - base : max_merges;
+    int valid = restored >= 0 && memcmp(checkpoint->byte_ids, tokenizer->byte_ids, 256 * sizeof(int)) == 0 &&
+                (base == 0 || (memcmp(checkpoint->merges.keys, tokenizer->merges.keys, base * sizeof(PairKey)) == 0 &&
+                               memcmp(checkpoint->merges.ids, tokenizer->merges.ids, base * sizeof(int32_t)) == 0));
+    for (int i = 0; valid && i < restored; i++)
+    {
+        int new_idx = tokenizer->vocab_size + i;
+        Pair pair = unpack_pair(checkpoint->merges.keys[base + i]);
+        valid = checkpoint->merges.ids[base + i] == new_idx && pair.first >= 0 && pair.second >= 0 &&
+                pair.first < new_idx && pair.second < new_idx;
+    }
+    if (!valid)
+    {
+        fprintf(stderr, "Error: %s is not a checkpoint of this training run.\n", options->checkpoint_path);
+        cleanup_tokenizer(checkpoint);
+        return -1;
+    }
+    for (int i = 0; i < restored; i++)
+    {
+        Pair pair = unpack_pair(checkpoint->merges.keys[base + i]);
+        append_merge(&tokenizer->merges, pair, tokenizer->vocab_size);
+        append_merged_token(tokenizer, pair);
+    }
+    cleanup_tokenizer(checkpoint);
+    if (restored > 0)
+    {
+        build_rank_table(tokenizer);
+    }
+    if (options->verbose)
+    {
+        printf("resumed %d merges from %s\n", restored, options->checkpoint_path);
+    }
+    return restored;
+}
+
+/**
+ * Encodes freshly converted training ids with all of the tokenizer's merges, so training
+ * can continue where the existing merges leave off. Untrained tokenizers return at once.
+ *
+ * @return The new length of `ids`.
+ */
+size_t apply_existing_merges(BasicTokenizer *tokenizer, int *ids, size_t length)
+{
+    if (tokenizer->merges.size == 0)
+    {
+        return length;
+    }
+    if (tokenizer->ranks.entries == NULL)
+    {
+        build_rank_table(tokenizer);
+    }
+    return apply_merges_linked(&tokenizer->ranks, ids, length, tokenizer->arena.allocator);
+}
+
+/**
+ * Returns how many chunks a sample of `length` bytes at `rate` takes: the number of chunks
+ * nearest to `rate` of the corpus, but at least one and no more than fit. `chunk_bytes` is
+ * the chunk size asked for, and is cut down to `length` if the corpus is smaller.
+ */
+size_t count_sample_strata(size_t length, double rate, size_t *chunk_bytes)
+{
+    *chunk_bytes = *chunk_bytes < length ? *chunk_bytes : length;
+    if (*chunk_bytes == 0)
+    {
+        return 0;
+    }
+    size_t max_strata = length / *chunk_bytes;
+    size_t num_strata = (size_t)(length * rate / *chunk_bytes + 0.5);
+    num_strata = num_strata > 0 ? num_strata : 1;
+    return num_strata < max_strata ? num_strata : max_strata;
+}
+
+/**
+ * Reads chunk `stratum` of a sample of `num_strata` chunks into `chunk`: `chunk_bytes`
+ * contiguous bytes at an offset within the stratum drawn from `options->sample_seed`, then
+ * trimmed to whole lines where they contain a newline, so few pairs straddle the seams
+ * between chunks. The corpus is either `text` or, when `text` is NULL, `file`.
+ *
+ * @return The number of bytes kept at the start of `chunk`, or -1 on a read error.
+ */
+ssize_t read_sample_chunk(FILE *file, const unsigned char *text, size_t length, const TrainOptions *options,
+                          size_t stratum, size_t num_strata, size_t chunk_bytes, unsigned char *chunk)
+{
+    size_t stratum_bytes = length / num_strata;
+    size_t offset = stratum * stratum_bytes + mix64(options->sample_seed ^ (stratum + 1)) % (stratum_bytes - chunk_bytes + 1);
+    if (text != NULL)
+    {
+        memcpy(chunk, text + offset, chunk_bytes);
+    }
+    else if (fseeko(file, offset, SEEK_SET) != 0 || fread(chunk, 1, chunk_bytes, file) != chunk_bytes)
+    {
+        return -1;
+    }
+
+    // Trim to whole lines, except at the ends of the corpus
+    size_t begin = 0;
+    size_t end = chunk_bytes;
+    if (offset > 0)
+    {
+        while (begin < chunk_bytes && chunk[begin] != '\n')
+        {
+            begin++;
+        }
+        begin++;
+    }
+    if (offset + chunk_bytes < length)
+    {
+        while (end > begin && chunk[end - 1] != '\n')
+        {
+            end--;
+        }
+    }
+    if (begin >= end)
+    {
+        return chunk_bytes; // No whole line in the chunk; keep it as it is
+    }
+    memmove(chunk, chunk + begin, end - begin);
+    return end - begin;
+}
+
+/**
+ * Builds the sample that sampled training learns from. The corpus is divided into equal
+ * strata, one per chunk, and each stratum contributes `options->sample_chunk_bytes`
+ * contiguous bytes (see read_sample_chunk), so the sample covers the whole corpus evenly
+ * and is reproducible. The corpus is either `text` or, when `text` is NULL, `file`.
+ *
+ * @return The sample, to be freed with basic_free, or NULL on a read error.
+ */
+unsigned char *read_sample(FILE *file, const unsigned char *text, size_t length, const TrainOptions *options,
+                           size_t *sample_length)
+{
+    size_t chunk_bytes = options->sample_chunk_bytes > 0 ? options->sample_chunk_bytes : DEFAULT_SAMPLE_CHUNK_BYTES;
+    size_t num_strata = count_sample_strata(length, options->sample_rate, &chunk_bytes);
+    unsigned char *sample = basic_alloc(MEMORY_IDS, num_strata * chunk_bytes + 1);
+    *sample_length = 0;
+    for (size_t s = 0; s < num_strata; s++)
+    {
+        ssize_t kept = read_sample_chunk(file, text, length, options, s, num_strata, chunk_bytes, sample + *sample_length);
+        if (kept < 0)
+        {
+            basic_free(sample);
+            return NULL;
+        }
+        *sample_length += kept;
+    }
+    return sample;
+}
+
+/**
+ * Returns the options for learning from a sample of `sample_length` of `length` bytes:
+ * `options` without sampling, and with min_frequency scaled down to the sample. The
+ * scaled value is rounded and kept at 2 or more, so a small sample still prunes and stops
+ * early when the caller asked for it.
+ */
+TrainOptions sample_train_options(const TrainOptions *options, size_t sample_length, size_t length)
+{
+    TrainOptions sampled = *options;
+    sampled.sample_rate = 1.0;
+    if (length > 0 && options->min_frequency > 1)
+    {
+        int64_t scaled = (int64_t)((double)options->min_frequency * sample_length / length + 0.5);
+        sampled.min_frequency = scaled > 2 ? scaled : 2;
+    }
+    return sampled;
+}
+
+/**
+ * Counts the pairs of one shard or segment of the ids with the stats engine selected in
+ * `options`, or with the hash engine's counting for the sketch engine, since a sketch of
+ * one part cannot tell which pairs are frequent across the whole corpus.
+ */
+void count_segment_pairs(PairCounts *stats, int *ids, size_t length, const TrainOptions *options,
+                         SortStatsBuffers *sort_buffers, LivePairs *live)
+{
+    if (options->stats_engine == STATS_ENGINE_SKETCH)
+    {
+        get_live_stats_into(stats, ids, length, live);
+    }
+    else
+    {
+        count_pairs(stats, ids, length, options, sort_buffers, NULL, live);
+    }
+}
+
+/**
+ * Learns merges `first_merge` up to `num_merges` from `ids` in this process, counting
+ * and merging one pass at a time. Working memory comes from `scratch`. With a minimum
+ * frequency, the exact engines alternate between two tables, so each pass can skip the
+ * pairs the one before it pruned (see LivePairs).
+ */
+void learn_merges(BasicTokenizer *tokenizer, Arena *scratch, int *ids, size_t length, int first_merge, int num_merges,
+                  const TrainOptions *options)
+{
+    PairCounts tables[2];
+    for (int t = 0; t < 2; t++)
+    {
+        init_pair_counts(&tables[t]);
+        tables[t].arena = scratch;
+    }
+    PairCounts *stats = &tables[0];
+    LivePairs live = {NULL, 0, options->min_frequency};
+    // The sketch engine prunes with its own floor, so only the exact engines use `live`
+    int track_live = options->min_frequency > 1 && options->stats_engine != STATS_ENGINE_SKETCH;
+    SortStatsBuffers sort_buffers;
+    if (options->stats_engine == STATS_ENGINE_SORT)
+    {
+        init_sort_stats_buffers(scratch, &sort_buffers, length);
+    }
+    CountMinSketch sketch;
+    if (options->stats_engine == STATS_ENGINE_SKETCH)
+    {
+        init_count_min_sketch(scratch, &sketch, options->sketch_bytes, length, options->sketch_min_count,
+                              options->min_frequency);
+    }
+    int per_pass = options->merges_per_pass > 1 ? options->merges_per_pass : 1;
+    MergeBatch batch;
+    init_merge_batch(&batch, scratch, per_pass, tokenizer->vocab_size + num_merges - first_merge);
+    for (int i = first_merge; i < num_merges;)
+    {
+        count_pairs(stats, ids, length, options, &sort_buffers, &sketch, track_live ? &live : NULL);
+        prune_pair_counts(stats, options->min_frequency);
+        if (stats->size == 0)
+        {
+            break; // Fewer than two tokens left, or no pair as frequent as min_frequency
+        }
+        int batch_size = num_merges - i < per_pass ? num_merges - i : per_pass;
+        int first_new_id = tokenizer->vocab_size;
+        int chosen = choose_merges(tokenizer, stats, &batch, batch_size, i, num_merges, options->verbose);
+        length = apply_merge_batch(&batch, ids, length);
+        maybe_write_checkpoint(tokenizer, i, i + chosen, options);
+        i += chosen;
+        if (track_live)
+        {
+            live.previous = stats;
+            live.first_new_id = first_new_id;
+            stats = stats == &tables[0] ? &tables[1] : &tables[0];
+        }
+    }
+    basic_free(batch.order);
+}
+
+/**
+ * Describes how the `length` ids of a worker's segment begin and end.
+ */
+void describe_segment(WorkerReport *report, const int *ids, size_t length)
+{
+    report->length = length;
+    report->first = length > 0 ? ids[0] : -1;
+    report->last = length > 0 ? ids[length - 1] : -1;
+    report->first_run = 0;
+    while ((size_t)report->first_run < length && ids[report->first_run] == report->first)
+    {
+        report->first_run++;
+    }
+    report->last_run = 0;
+    while ((size_t)report->last_run < length && ids[length - 1 - report->last_run] == report->last)
+    {
+        report->last_run++;
+    }
+}
+
+/**
+ * The loop of a training worker process, which owns `length` ids of the corpus: count
+ * their pairs, report them on `reports`, apply the merges that arrive on `commands`, and
+ * again, until the coordinator ends training or goes away.
+ */
+void run_training_worker(FILE *commands, FILE *reports, int *ids, size_t length, int vocab_size, Allocator allocator,
+                         const TrainOptions *options)
+{
+    Arena scratch;
+    init_arena(&scratch, allocator);
+    PairCounts stats;
+    init_pair_counts(&stats);
+    stats.arena = &scratch;
+    SortStatsBuffers sort_buffers;
+    if (options->stats_engine == STATS_ENGINE_SORT)
+    {
+        init_sort_stats_buffers(&scratch, &sort_buffers, length);
+    }
+    int per_pass = options->merges_per_pass > 1 ? options->merges_per_pass : 1;
+    MergeBatch batch;
+    init_merge_batch(&batch, &scratch, per_pass, vocab_size);
+    Pair *pairs = arena_alloc(&scratch, MEMORY_OTHER, per_pass * sizeof(Pair));
+    int *merged = arena_alloc(&scratch, MEMORY_OTHER, per_pass * sizeof(int));
+
+    for (;;)
+    {
+        count_segment_pairs(&stats, ids, length, options, &sort_buffers, NULL);
+        WorkerReport report;
+        describe_segment(&report, ids, length);
+        report.num_pairs = stats.size;
+        if (fwrite(&report, sizeof(report), 1, reports) != 1 ||
+            (stats.size > 0 && (fwrite(stats.keys, sizeof(PairKey), stats.size, reports) != (size_t)stats.size ||
+                                fwrite(stats.counts, sizeof(int64_t), stats.size, reports) != (size_t)stats.size)) ||
+            fflush(reports) != 0)
+        {
+            break;
+        }
+
+        WorkerCommand command;
+        if (fread(&command, sizeof(command), 1, commands) != 1 || command.size <= 0 || command.size > per_pass ||
+            fread(pairs, sizeof(Pair), command.size, commands) != (size_t)command.size ||
+            fread(merged, sizeof(int), command.size, commands) != (size_t)command.size)
+        {
+            break;
+        }
+        reset_merge_batch(&batch);
+        for (int b = 0; b < command.size; b++)
+        {
+            add_merge_to_batch(&batch, pairs[b], merged[b]);
+        }
+        if (command.join_first)
+        {
+            ids++; // Merged into the previous segment's last id
+            length--;
+        }
+        length = apply_merge_batch(&batch, ids, length);
+        if (command.join_last >= 0)
+        {
+            ids[length - 1] = command.join_last;
+        }
+    }
+    arena_release(&scratch);
+}
+
+/**
+ * Collects one round of reports from `workers` into `stats`. Segments are added in
+ * corpus order, each pair straddling two segments between them, so `stats` lists pairs
+ * in order of first occurrence exactly as counting the whole sequence does.
+ *
+ * @return 0 on success, or -1 if a worker's report could not be read.
+ */
+int receive_worker_stats(PairCounts *stats, TrainingWorker *workers, int num_workers, PairCounts *received)
+{
+    clear_pair_counts(stats);
+    int previous = -1; // Last worker whose segment is not empty
+    for (int w = 0; w < num_workers; w++)
+    {
+        WorkerReport *report = &workers[w].report;
+        if (fread(report, sizeof(*report), 1, workers[w].reports) != 1)
+        {
+            return -1;
+        }
+        if (report->num_pairs > received->capacity)
+        {
+            received->capacity = report->num_pairs;
+            received->keys = basic_realloc(MEMORY_PAIR_COUNTS, received->keys, received->capacity * sizeof(PairKey));
+            received->counts = basic_realloc(MEMORY_PAIR_COUNTS, received->counts, received->capacity * sizeof(int64_t));
+        }
+        size_t num_pairs = report->num_pairs;
+        if (num_pairs > 0 && (fread(received->keys, sizeof(PairKey), num_pairs, workers[w].reports) != num_pairs ||
+                              fread(received->counts, sizeof(int64_t), num_pairs, workers[w].reports) != num_pairs))
+        {
+            return -1;
+        }
+        if (report->length == 0)
+        {
+            continue;
+        }
+        if (previous >= 0)
+        {
+            add_pair_key(stats, pair_key(workers[previous].report.last, report->first), 1);
+        }
+        for (int i = 0; i < report->num_pairs; i++)
+        {
+            add_pair_key(stats, received->keys[i], received->counts[i]);
+        }
+        previous = w;
+    }
+    return 0;
+}
+
+/**
+ * Sends the merges of `batch` to `workers`, telling each which of its end ids merge
+ * across a segment boundary. For a pair of two different tokens that is every straddling
+ * occurrence. Runs of one token merged with itself pair up from their start, so an
+ * occurrence straddles the boundary when an odd number of the token precede it in the
+ * run, counting through earlier segments made of nothing else.
+ *
+ * @return 0 on success, or -1 if a command could not be written.
+ */
+int send_worker_merges(const MergeBatch *batch, TrainingWorker *workers, int num_workers)
+{
+    int previous = -1;
+    int64_t run = 0; // Ids equal to the previous segment's last id that end it, counted through earlier segments
+    for (int w = 0; w < num_workers; w++)
+    {
+        workers[w].command.size = batch->size;
+        workers[w].command.join_first = 0;
+        workers[w].command.join_last = -1;
+        const WorkerReport *report = &workers[w].report;
+        if (report->length == 0)
+        {
+            continue;
+        }
+        int64_t before = 0; // Ids equal to `first` that precede the segment in its run
+        if (previous >= 0)
+        {
+            int last = workers[previous].report.last;
+            before = last == report->first ? run : 0;
+            int b = batch->batch_of[last];
+            if (b >= 0 && batch->pairs[b].second == report->first &&
+                (batch->pairs[b].first != batch->pairs[b].second || before % 2 == 1))
+            {
+                workers[previous].command.join_last = batch->merged[b];
+                workers[w].command.join_first = 1;
+            }
+        }
+        run = report->first_run == report->length ? before + report->length : report->last_run;
+        previous = w;
+    }
+
+    for (int w = 0; w < num_workers; w++)
+    {
+        if (fwrite(&workers[w].command, sizeof(WorkerCommand), 1, workers[w].commands) != 1 ||
+            fwrite(batch->pairs, sizeof(Pair), batch->size, workers[w].commands) != (size_t)batch->size ||
+            fwrite(batch->merged, sizeof(int), batch->size, workers[w].commands) != (size_t)batch->size ||
+            fflush(workers[w].commands) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Learns merges `first_merge` up to `num_merges` like learn_merges, with the counting and
+ * merging spread over `options->num_workers` worker processes. The ids are split into one
+ * contiguous segment per worker; the workers inherit them through fork and then talk to
+ * this process, the coordinator, over a pair of pipes each. Every round, each worker
+ * counts its segment's pairs and reports them; the coordinator adds them up with the
+ * pairs straddling the segments, chooses merges exactly as learn_merges does and sends
+ * them back for every worker to apply to its own segment, handing over the occurrences
+ * that straddle a boundary. The merges learned are identical to those of a
+ * single-process run with the same options, with one exception noted below.
+ *
+ * The coordinator's pair table holds every distinct pair, and each round moves each
+ * worker's pair counts through its pipe, so this pays off when counting and merging, not
+ * choosing, dominate: long sequences with modest vocabularies. As in train_out_of_core,
+ * the sketch engine counts like the hash engine in the workers, so its batches (with
+ * merges_per_pass above 1) are those of the hash engine.
+ *
+ * SIGPIPE is ignored while the workers run, so a worker that dies only fails the write
+ * to its pipe instead of killing the coordinator; the previous disposition is restored
+ * before returning.
+ *
+ * @return 0 on success, or -1 if the workers could not be started or one of them failed.
+ *         Merges learned before a failure are kept.
+ */
+int train_with_workers(BasicTokenizer *tokenizer, Arena *scratch, int *ids, size_t length, int first_merge,
+                       int num_merges, const TrainOptions *options)
+{
+    if (first_merge >= num_merges)
+    {
+        return 0;
+    }
+    int num_workers = options->num_workers;
+    int vocab_size = tokenizer->vocab_size + num_merges - first_merge;
+    TrainingWorker *workers = arena_alloc(scratch, MEMORY_OTHER, num_workers * sizeof(TrainingWorker));
+    struct sigaction ignore_sigpipe;
+    struct sigaction previous_sigpipe;
+    memset(&ignore_sigpipe, 0, sizeof(ignore_sigpipe));
+    ignore_sigpipe.sa_handler = SIG_IGN;
+    sigemptyset(&ignore_sigpipe.sa_mask);
+    sigaction(SIGPIPE, &ignore_sigpipe, &previous_sigpipe);
+    int started = 0;
+    fflush(NULL); // Output still buffered would otherwise be written again by every worker
+    for (; started < num_workers; started++)
+    {
+        int command_pipe[2];
+        int report_pipe[2];
+        if (pipe(command_pipe) != 0)
+        {
+            break;
+        }
+        if (pipe(report_pipe) != 0)
+        {
+            close(command_pipe[0]);
+            close(command_pipe[1]);
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            // Only the coordinator may hold the other workers' pipes, or they never see it go away
+            for (int w = 0; w < started; w++)
+            {
+                fclose(workers[w].commands);
+                fclose(workers[w].reports);
+            }
+            close(command_pipe[1]);
+            close(report_pipe[0]);
+            size_t begin = length * started / num_workers;
+            size_t end = length * (started + 1) / num_workers;
+            FILE *commands = fdopen(command_pipe[0], "rb");
+            FILE *reports = fdopen(report_pipe[1], "wb");
+            if (commands != NULL && reports != NULL)
+            {
+                run_training_worker(commands, reports, ids + begin, end - begin, vocab_size, tokenizer->arena.allocator,
+                                    options);
+            }
+            _exit(0);
+        }
+        close(command_pipe[0]);
+        close(report_pipe[1]);
+        workers[started].pid = pid;
+        workers[started].commands = fdopen(command_pipe[1], "wb");
+        workers[started].reports = fdopen(report_pipe[0], "rb");
+        if (pid < 0 || workers[started].commands == NULL || workers[started].reports == NULL)
+        {
+            if (workers[started].commands != NULL)
+            {
+                fclose(workers[started].commands);
+            }
+            if (workers[started].reports != NULL)
+            {
+                fclose(workers[started].reports);
+            }
+            if (pid > 0)
+            {
+                waitpid(pid, NULL, 0);
+            }
+            break;
+        }
+    }
+    int failed = started < num_workers;
+    if (failed)
+    {
+        fprintf(stderr, "Error: cannot start %d training worker processes.\n", num_workers);
+    }
+
+    PairCounts stats;
+    init_pair_counts(&stats);
+    stats.arena = scratch;
+    PairCounts received;
+    init_pair_counts(&received);
+    int per_pass = options->merges_per_pass > 1 ? options->merges_per_pass : 1;
+    MergeBatch batch;
+    init_merge_batch(&batch, scratch, per_pass, vocab_size);
+    for (int i = first_merge; i < num_merges && !failed;)
+    {
+        if (receive_worker_stats(&stats, workers, num_workers, &received) != 0)
+        {
+            fprintf(stderr, "Error: lost a training worker process.\n");
+            failed = 1;
+            break;
+        }
+        prune_pair_counts(&stats, options->min_frequency);
+        if (stats.size == 0)
+        {
+            break;
+        }
+        int batch_size = num_merges - i < per_pass ? num_merges - i : per_pass;
+        int chosen = choose_merges(tokenizer, &stats, &batch, batch_size, i, num_merges, options->verbose);
+        maybe_write_checkpoint(tokenizer, i, i + chosen, options);
+        i += chosen;
+        if (i < num_merges && send_worker_merges(&batch, workers, num_workers) != 0)
+        {
+            fprintf(stderr, "Error: lost a training worker process.\n");
+            failed = 1;
+        }
+    }
+
+    // Closing the pipes ends the workers
+    for (int w = 0; w < started; w++)
+    {
+        fclose(workers[w].commands);
+        fclose(workers[w].reports);
+    }
+    for (int w = 0; w < started; w++)
+    {
+        waitpid(workers[w].pid, NULL, 0);
+    }
+    sigaction(SIGPIPE, &previous_sigpipe, NULL);
+    basic_free(received.keys);
+    basic_free(received.counts);
+    basic_free(batch.order);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Trains on exactly `length` bytes of `text`, which need not be NUL-terminated and may
+ * contain NUL bytes. This is the entry point behind train, train_with_options and
+ * train_file. The text is only read while it is converted to ids at the start.
+ *
+ * A tokenizer that already has merges is extended rather than retrained: the text is
+ * first encoded with the existing merges, which costs far less than relearning them, and
+ * new merges continue from the current vocab_size. This grows a vocabulary for a new
+ * domain while keeping every existing token id, so text encoded with the old tokenizer
+ * decodes the same with the new one.
+ *
+ * With `options->sample_rate` below 1, the merges are learned from a sample of the text
+ * (see read_sample) instead, which costs roughly that fraction of a full run and suits
+ * sweeps over candidate vocabulary sizes. Frequent pairs are ranked much the same in a
+ * fair sample, so the early merges mostly agree with a full run and the differences
+ * collect among the rare late ones. `options->refine_merges` of those are then learned
+ * exactly on the full text, extending the sampled tokenizer, at the cost of one
+ * re-encoding of the text plus one pass per refined merge.
+ *
+ * With `options->merges_per_pass` above 1, each pass over the ids learns up to that many
+ * merges at once (see choose_merges): far fewer passes, at the price of a merge list that
+ * only approximates BPE. compare_merges reports how closely it matches an exact run.
+ *
+ * With `options->checkpoint_path` set, the merges are saved there as a model file every
+ * `checkpoint_interval` merges. Rerunning the same training with `options->resume` set
+ * picks up after the last checkpoint and learns the same merges an uninterrupted run does.
+ *
+ * With `options->num_workers` above 1, the counting and merging is spread over that many
+ * worker processes (see train_with_workers), which learn the same merges as this process.
+ *
+ * @param tokenizer Pointer to the BasicTokenizer instance to be trained.
+ * @param text The training bytes.
+ * @param length The number of bytes in `text`.
+ * @param vocab_size The desired size of the vocabulary after training. Nothing is learned
+ *                   if the tokenizer is already this large.
+ * @param options Training options.
+ * @return 0 on success, or -1 if the tokenizer is read-only, the ids do not fit in memory,
+ *         the checkpoint to resume from is unusable or a worker process failed.
+ */
+int train_bytes(BasicTokenizer *tokenizer, const unsigned char *text, size_t length, int vocab_size,
+                const TrainOptions *options)
+{
+    if (tokenizer->mapping != NULL || tokenizer->embedded)
+    {
+        fprintf(stderr, "Error: cannot train a read-only tokenizer loaded from a model file or embedded.\n");
+        return -1;
+    }
+    if (options->sample_rate > 0 && options->sample_rate < 1)
+    {
+        size_t sample_length;
+        unsigned char *sample = read_sample(NULL, text, length, options, &sample_length);
+        if (options->verbose)
+        {
+            printf("training on a sample of %zu of %zu bytes\n", sample_length, length);
+        }
+        TrainOptions sampled = sample_train_options(options, sample_length, length);
+        int result = train_bytes(tokenizer, sample, sample_length, vocab_size - options->refine_merges, &sampled);
+        basic_free(sample);
+        if (result == 0 && options->refine_merges > 0)
+        {
+            TrainOptions exact = *options;
+            exact.sample_rate = 1.0;
+            result = train_bytes(tokenizer, text, length, vocab_size, &exact);
+        }
+        return result;
+    }
+    // Working buffers come from a scratch arena released in one go when training ends
+    Arena scratch;
+    init_arena(&scratch, tokenizer->arena.allocator);
+    size_t text_length = length;
+    int *ids = arena_alloc(&scratch, MEMORY_IDS, text_length * sizeof(int));
+    if (ids == NULL)
+    {
+        fprintf(stderr, "Error: cannot allocate ids for %zu bytes of training text.\n", length);
+        arena_release(&scratch);
+        return -1;
+    }
+    for (size_t i = 0; i < text_length; i++)
+    {
+        ids[i] = tokenizer->byte_ids[text[i]];
+    }
+
+    int num_merges = vocab_size > tokenizer->vocab_size ? vocab_size - tokenizer->vocab_size : 0;
+    int restored = resume_from_checkpoint(tokenizer, num_merges, options);
+    if (restored < 0)
+    {
+        arena_release(&scratch);
+        return -1;
+    }
+    text_length = apply_existing_merges(tokenizer, ids, text_length);
+
+    int result = 0;
+    if (options->num_workers > 1)
+    {
+        result = train_with_workers(tokenizer, &scratch, ids, text_length, restored, num_merges, options);
+    }
+    else
+    {
+        learn_merges(tokenizer, &scratch, ids, text_length, restored, num_merges, options);
+    }
+    arena_release(&scratch);
+    build_rank_table(tokenizer);
+    freeze_merges(tokenizer);
+    if (options->verbose)
+    {
+        print_memory_usage(stdout);
+    }
+    return result;
+}
+
+/**
+ * Trains the tokenizer like train, with the pair counting strategy and other settings
+ * taken from `options`. The learned merges do not depend on the stats engine; only speed
+ * and memory use do. The hash engine suits most inputs. The sort engine needs about 28
+ * bytes per input byte of scratch memory but streams through it sequentially and spreads
+ * its radix passes over `num_threads` threads, which can pay off on large corpora with
+ * many distinct pairs. The sketch engine takes two passes per merge but only tables the
+ * frequent pairs (see get_stats_sketched), so the pair table stays small however many
+ * distinct pairs the input has; its count-min sketch takes `sketch_bytes` of memory.
+ *
+ * With `min_frequency` above 1, training stops early once no pair occurs that often, and
+ * rarer pairs are dropped from the stats after every count. The most frequent count never
+ * grows as merges are made, so a stop is final and the merges learned are exactly the
+ * first merges of an unrestricted run. A sampled run scales the threshold to the sample.
+ *
+ * @param tokenizer Pointer to the BasicTokenizer instance to be trained.
+ * @param text NUL-terminated training text.
+ * @param vocab_size The desired size of the vocabulary after training.
+ * @param options Training options, normally default_train_options() with some fields changed.
+ *
+ * Example usage:
+ * TrainOptions options = default_train_options();
+ * options.stats_engine = STATS_ENGINE_SORT;
+ * options.num_threads = 8;
+ * train_with_options(tokenizer, text, 4096, &options);
+ */
+void train_with_options(BasicTokenizer *tokenizer, unsigned char *text, int vocab_size, const TrainOptions *options)
+{
+    train_bytes(tokenizer, text, strlen((char *)text), vocab_size, options);
+}
+
+/**
+ * Trains the BasicTokenizer by processing the given text to identify and merge
+ * frequent pairs of characters (or tokens). This function adapts the Byte Pair Encoding
+ * algorithm to progressively merge the most frequent adjacent pairs of tokens into
+ * single tokens, thereby increasing the tokenizer's vocabulary based on the text input.
+ *
+ * The function first converts the input text into an array of integers (`ids`), where
+ * each integer represents the ASCII value of a character in the text. It then performs
+ * a series of merges, each time finding the most frequent pair of tokens and replacing
+ * all occurrences of that pair in the text with a new token. Each new token is added
+ * to the tokenizer's vocabulary. If the tokenizer is already trained, the new merges
+ * extend it, as described for train_bytes.
+ *
+ * @param tokenizer Pointer to the BasicTokenizer instance to be trained.
+ * @param text Unsigned char array containing the input text to be processed.
+ * @param vocab_size The desired size of the vocabulary after training. The number of
+ *                   merges performed is determined by the difference between `vocab_size`
+ *                   and the tokenizer's current vocabulary size.
+ * @param verbose If non-zero, the function prints detailed logs of each merge operation,
+ *                showing progress and statistics such as which pairs were merged and
+ *                the number of occurrences.
+ *
+ * Example usage:
+ * BasicTokenizer* tokenizer = create_basic_tokenizer();
+ * unsigned char text[] = "example text for tokenizer training";
+ * train(tokenizer, text, 300, 1);  // Trains tokenizer to expand its vocab to 300 tokens
+ */
+void train(BasicTokenizer *tokenizer, unsigned char *text, int vocab_size, int verbose)
+{
+    TrainOptions options = default_train_options();
+    options.verbose = verbose;
+    train_with_options(tokenizer, text, vocab_size, &options);
+}
+
+/**
+ * Trains the tokenizer on the contents of a file without reading it into memory first.
+ * The file is mapped read-only and advised for sequential access, so the kernel reads
+ * ahead and drops pages behind, and the ids are built straight from the mapping: no heap
+ * copy of the raw text is ever made, and the mapped pages are clean page cache the kernel
+ * can reclaim, so peak memory is essentially the ids array. The whole file is one training
+ * sequence, as with train; use train_out_of_core for corpora whose ids do not fit in memory.
+ *
+ * @param tokenizer Pointer to the BasicTokenizer instance to be trained.
+ * @param path Path of the corpus file.
+ * @param vocab_size The desired size of the vocabulary after training.
+ * @param options Training options, or NULL for default_train_options().
+ * @return 0 on success, or -1 if the file cannot be mapped or training fails.
+ *
+ * Example usage:
+ * BasicTokenizer *tokenizer = create_basic_tokenizer();
+ * if (train_file(tokenizer, "corpus.txt", 4096, NULL) != 0)
+ *     fprintf(stderr, "training failed\n");
+ */
+int train_file(BasicTokenizer *tokenizer, const char *path, int vocab_size, const TrainOptions *options)
+{
+    TrainOptions defaults = default_train_options();
+    options = options != NULL ? options : &defaults;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: cannot open %s.\n", path);
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        fprintf(stderr, "Error: cannot stat %s.\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t size = info.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return train_bytes(tokenizer, (const unsigned char *)"", 0, vocab_size, options);
+    }
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: cannot map %s.\n", path);
+        return -1;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    int result = train_bytes(tokenizer, mapping, size, vocab_size, options);
+    munmap(mapping, size);
+    return result;
+}
+
+/**
+ * Packs `length` ids into `id_size`-byte integers in `buffer` and writes them at the
+ * current position of `file`. Returns 0 on success or -1 on a write error.
+ */
+int write_shard(FILE *file, const int *ids, int length, int id_size, void *buffer)
+{
+    if (id_size == sizeof(uint16_t))
+    {
+        uint16_t *packed = buffer;
+        for (int i = 0; i < length; i++)
+        {
+            packed[i] = (uint16_t)ids[i];
+        }
+    }
+    else
+    {
+        memcpy(buffer, ids, (size_t)length * sizeof(int));
+    }
+    return fwrite(buffer, id_size, length, file) == (size_t)length ? 0 : -1;
+}
+
+/**
+ * Reads `length` ids stored by write_shard from the current position of `file`. Returns
+ * 0 on success or -1 on a read error.
+ */
+int read_shard(FILE *file, int *ids, int length, int id_size, void *buffer)
+{
+    if (fread(buffer, id_size, length, file) != (size_t)length)
+    {
+        return -1;
+    }
+    if (id_size == sizeof(uint16_t))
+    {
+        uint16_t *packed = buffer;
+        for (int i = 0; i < length; i++)
+        {
+            ids[i] = packed[i];
+        }
+    }
+    else
+    {
+        memcpy(ids, buffer, (size_t)length * sizeof(int));
+    }
+    return 0;
+}
+
+/**
+ * Counts the pairs of one shard and adds them to the running totals in `stats`. Shards
+ * are added in corpus order, so `stats` lists pairs in order of first occurrence across
+ * the whole corpus, as single-sequence counting does. Pairs `live` shows to be dead are
+ * left out.
+ */
+void add_shard_stats(PairCounts *stats, PairCounts *shard_stats, int *ids, int length, const TrainOptions *options,
+                     SortStatsBuffers *sort_buffers, LivePairs *live)
+{
+    count_segment_pairs(shard_stats, ids, length, options, sort_buffers, live);
+    for (int i = 0; i < shard_stats->size; i++)
+    {
+        add_pair_key(stats, shard_stats->keys[i], shard_stats->counts[i]);
+    }
+}
+
+/**
+ * Trains the tokenizer on a corpus file that may be far larger than memory. The corpus is
+ * read once and split into shards of at most `options->shard_bytes` bytes, cut after the
+ * last newline in each shard where there is one. The shards are kept on disk as token ids,
+ * two bytes each while the vocabulary fits in 16 bits and four otherwise, in
+ * `options->scratch_path` or an anonymous temporary file.
+ *
+ * Every merge then takes one sequential sweep over that file: each shard is read, the
+ * previous merge is applied, the shorter shard is written back in place (the file only
+ * ever shrinks) and its pairs are added to the totals that choose the next merge. Memory
+ * use is bounded by the shard size (about 4 + id size bytes per shard byte, plus 28 more
+ * with the sort engine) and the pair table, independent of the corpus size. The sketch
+ * engine counts shards like the hash engine, since a sketch of one shard cannot tell
+ * which pairs are frequent across the corpus.
+ *
+ * Shards are independent sequences: a pair that straddles a shard boundary is never
+ * counted or merged. Cutting at newlines makes this rare, and a corpus that fits in one
+ * shard trains exactly like train_with_options. Raw bytes become ids 0..255, as in train.
+ * Sampling fills the shards with the sampled chunks of the corpus (see read_sample) rather
+ * than all of it, packing whole chunks into each shard; refinement then sweeps the whole
+ * corpus. Chunks larger than a shard are cut to the shard size. Extending a trained tokenizer, checkpoints and
+ * resuming work as in train_bytes; the existing and resumed merges are applied to each
+ * shard during the first sweep, so they cost no extra passes over the file. Worker
+ * processes (num_workers) are not used here.
+ *
+ * @param tokenizer Pointer to the BasicTokenizer instance to be trained.
+ * @param corpus_path Path of the corpus file.
+ * @param vocab_size The desired size of the vocabulary after training.
+ * @param options Training options; shard_bytes and scratch_path apply here.
+ * @return 0 on success, or -1 if a file could not be opened, read or written. Merges
+ *         learned before an I/O error are kept.
+ *
+ * Example usage:
+ * TrainOptions options = default_train_options();
+ * options.shard_bytes = 256 * 1024 * 1024;
+ * options.scratch_path = "/data/scratch/shards.bin";
+ * train_out_of_core(tokenizer, "/data/corpus.txt", 65536, &options);
+ */
+int train_out_of_core(BasicTokenizer *tokenizer, const char *corpus_path, int vocab_size, const TrainOptions *options)
+{
+    if (tokenizer->mapping != NULL || tokenizer->embedded)
+    {
+        fprintf(stderr, "Error: cannot train a read-only tokenizer loaded from a model file or embedded.\n");
+        return -1;
+    }
+    FILE *corpus = fopen(corpus_path, "rb");
+    if (corpus == NULL)
+    {
+        fprintf(stderr, "Error: cannot open %s.\n", corpus_path);
+        return -1;
+    }
+    size_t shard_bytes = options->shard_bytes;
+    shard_bytes = shard_bytes < 2 ? 2 : shard_bytes > MAX_SHARD_BYTES ? MAX_SHARD_BYTES : shard_bytes;
+
+    // A sampled run learns all but the refinement merges from the chunks of the sample
+    int sampling = options->sample_rate > 0 && options->sample_rate < 1;
+    off_t corpus_size = 0;
+    size_t chunk_bytes = 0;
+    size_t num_strata = 0;
+    if (sampling)
+    {
+        corpus_size = fseeko(corpus, 0, SEEK_END) == 0 ? ftello(corpus) : -1;
+        if (corpus_size < 0)
+        {
+            fprintf(stderr, "Error: cannot read a sample of %s.\n", corpus_path);
+            fclose(corpus);
+            return -1;
+        }
+        chunk_bytes = options->sample_chunk_bytes > 0 ? options->sample_chunk_bytes : DEFAULT_SAMPLE_CHUNK_BYTES;
+        chunk_bytes = chunk_bytes < shard_bytes ? chunk_bytes : shard_bytes;
+        num_strata = count_sample_strata(corpus_size, options->sample_rate, &chunk_bytes);
+        vocab_size -= options->refine_merges;
+    }
+    int num_merges = vocab_size > tokenizer->vocab_size ? vocab_size - tokenizer->vocab_size : 0;
+    int restored = resume_from_checkpoint(tokenizer, num_merges, options);
+    if (restored < 0)
+    {
+        fclose(corpus);
+        return -1;
+    }
+    FILE *shards = options->scratch_path != NULL ? fopen(options->scratch_path, "w+b") : tmpfile();
+    if (shards == NULL)
+    {
+        fprintf(stderr, "Error: cannot create the shard file %s.\n", options->scratch_path ? options->scratch_path : "(temporary)");
+        fclose(corpus);
+        return -1;
+    }
+    int id_size = tokenizer->vocab_size + num_merges - restored <= 65536 ? sizeof(uint16_t) : sizeof(uint32_t);
+
+    Arena scratch;
+    init_arena(&scratch, tokenizer->arena.allocator);
+    unsigned char *buffer = arena_alloc(&scratch, MEMORY_IDS, shard_bytes * id_size); // Raw text, then packed ids
+    int *ids = arena_alloc(&scratch, MEMORY_IDS, shard_bytes * sizeof(int));
+    // With a minimum frequency, sweeps alternate between two tables of totals, so each
+    // sweep can skip the pairs the one before it pruned (see LivePairs)
+    PairCounts tables[2];
+    PairCounts shard_stats;
+    for (int t = 0; t < 2; t++)
+    {
+        init_pair_counts(&tables[t]);
+        tables[t].arena = &scratch;
+    }
+    PairCounts *stats = &tables[0];
+    enable_byte_pair_table(stats);
+    LivePairs live = {NULL, 0, 0}; // Shard counts are partial, so only known-dead pairs are skipped
+    init_pair_counts(&shard_stats);
+    shard_stats.arena = &scratch;
+    SortStatsBuffers sort_buffers;
+    if (options->stats_engine == STATS_ENGINE_SORT)
+    {
+        init_sort_stats_buffers(&scratch, &sort_buffers, shard_bytes);
+    }
+    int per_pass = options->merges_per_pass > 1 ? options->merges_per_pass : 1;
+    MergeBatch batch;
+    init_merge_batch(&batch, &scratch, per_pass, tokenizer->vocab_size + num_merges - restored);
+    int *shard_lengths = NULL;
+    int num_shards = 0;
+    int failed = 0;
+    size_t next_stratum = 0;
+    size_t sample_length = 0;
+
+    // First sweep: cut the corpus, or the sample, into shards, encode them with the merges
+    // the tokenizer already has, store them as ids and count their pairs
+    for (;;)
+    {
+        size_t length = 0;
+        if (sampling)
+        {
+            while (next_stratum < num_strata && length + chunk_bytes <= shard_bytes)
+            {
+                ssize_t kept = read_sample_chunk(corpus, NULL, corpus_size, options, next_stratum++, num_strata,
+                                                 chunk_bytes, buffer + length);
+                if (kept < 0)
+                {
+                    failed = 1;
+                    next_stratum = num_strata;
+                    break;
+                }
+                length += kept;
+            }
+            sample_length += length;
+        }
+        else
+        {
+            length = fread(buffer, 1, shard_bytes, corpus);
+            if (length == shard_bytes)
+            {
+                size_t cut = length;
+                while (cut > 0 && buffer[cut - 1] != '\n')
+                {
+                    cut--;
+                }
+                if (cut > 0 && cut < length && fseeko(corpus, -(off_t)(length - cut), SEEK_CUR) == 0)
+                {
+                    length = cut; // The rest starts the next shard
+                }
+            }
+        }
+        if (length == 0)
+        {
+            break;
+        }
+        for (size_t i = 0; i < length; i++)
+        {
+            ids[i] = tokenizer->byte_ids[buffer[i]];
+        }
+        length = apply_existing_merges(tokenizer, ids, length);
+        shard_lengths = basic_realloc(MEMORY_OTHER, shard_lengths, (num_shards + 1) * sizeof(int));
+        shard_lengths[num_shards++] = length;
+        failed |= write_shard(shards, ids, length, id_size, buffer);
+        add_shard_stats(stats, &shard_stats, ids, length, options, &sort_buffers, NULL);
+    }
+    failed |= ferror(corpus) != 0;
+    fclose(corpus);
+    int64_t min_frequency = options->min_frequency;
+    if (sampling)
+    {
+        min_frequency = sample_train_options(options, sample_length, corpus_size).min_frequency;
+        if (options->verbose)
+        {
+            printf("training on a sample of %zu of %lld bytes\n", sample_length, (long long)corpus_size);
+        }
+    }
+
+    for (int i = restored; i < num_merges && !failed;)
+    {
+        // Prune only once a sweep has finished: a pair's count is partial until then
+        prune_pair_counts(stats, min_frequency);
+        if (stats->size == 0)
+        {
+            break;
+        }
+        int batch_size = num_merges - i < per_pass ? num_merges - i : per_pass;
+        int first_new_id = tokenizer->vocab_size;
+        int chosen = choose_merges(tokenizer, stats, &batch, batch_size, i, num_merges, options->verbose);
+        maybe_write_checkpoint(tokenizer, i, i + chosen, options);
+        i += chosen;
+        if (i == num_merges)
+        {
+            break; // No counts needed after the last merge
+        }
+
+        // Apply the merges to every shard, compacting the file, and count for the next pass
+        if (min_frequency > 1)
+        {
+            live.previous = stats;
+            live.first_new_id = first_new_id;
+            stats = stats == &tables[0] ? &tables[1] : &tables[0];
+        }
+        clear_pair_counts(stats);
+        enable_byte_pair_table(stats);
+        off_t read_at = 0;
+        off_t write_at = 0;
+        for (int s = 0; s < num_shards && !failed; s++)
+        {
+            int length = shard_lengths[s];
+            failed |= fseeko(shards, read_at, SEEK_SET) != 0 || read_shard(shards, ids, length, id_size, buffer) != 0;
+            read_at += (off_t)length * id_size;
+            length = (int)apply_merge_batch(&batch, ids, length);
+            shard_lengths[s] = length;
+            failed |= fseeko(shards, write_at, SEEK_SET) != 0 || write_shard(shards, ids, length, id_size, buffer) != 0;
+            write_at += (off_t)length * id_size;
+            add_shard_stats(stats, &shard_stats, ids, length, options, &sort_buffers, &live);
+        }
+    }
+    if (failed)
+    {
+        fprintf(stderr, "Error: I/O failure during out-of-core training on %s.\n", corpus_path);
+    }
+
+    fclose(shards);
+    if (options->scratch_path != NULL)
+    {
+        remove(options->scratch_path);
+    }
+    basic_free(shard_lengths);
+    basic_free(batch.order);
+    arena_release(&scratch);
+    build_rank_table(tokenizer);
+    freeze_merges(tokenizer);
+    if (options->verbose)
+    {
+        print_memory_usage(stdout);
+    }
+    if (failed)
+    {
+        return -1;
+    }
+    if (sampling && options->refine_merges > 0)
+    {
+        TrainOptions exact = *options;
+        exact.sample_rate = 1.0;
+        return train_out_of_core(tokenizer, corpus_path, vocab_size + options->refine_merges, &exact);
+    }
+    return 0;
+}
+
+/**
+ * Hashes `length` bytes with 64-bit FNV-1a.
+ */
+uint64_t hash_bytes(const unsigned char *bytes, int length)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (int i = 0; i < length; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/**
+ * Measures how far the merges of `tokenizer` stray from those of `reference`, typically
+ * a batched training run (TrainOptions.merges_per_pass above 1) against exact BPE on the
+ * same corpus. Token ids stop lining up after the first difference, so beyond the common
+ * prefix merges are matched by the bytes of the token they create: a merged token of
+ * `tokenizer` is shared if `reference` learned the same string, and its rank shift is
+ * the distance between the two merge positions.
+ *
+ * @param tokenizer The tokenizer to assess.
+ * @param reference The tokenizer it is compared against.
+ * @return The common prefix length, shared token count and mean rank shift.
+ *
+ * Example usage:
+ * MergeDivergence d = compare_merges(batched, exact);
+ * printf("%d/%d tokens shared, mean shift %.1f, first %d merges identical\n",
+ *        d.shared_tokens, d.compared_tokens, d.mean_rank_shift, d.common_prefix);
+ */
+MergeDivergence compare_merges(const BasicTokenizer *tokenizer, const BasicTokenizer *reference)
+{
+    const MergeList *merges = &tokenizer->merges;
+    const MergeList *reference_merges = &reference->merges;
+    MergeDivergence divergence;
+    memset(&divergence, 0, sizeof(divergence));
+    while (divergence.common_prefix < merges->size && divergence.common_prefix < reference_merges->size &&
+           merges->keys[divergence.common_prefix] == reference_merges->keys[divergence.common_prefix] &&
+           merges->ids[divergence.common_prefix] == reference_merges->ids[divergence.common_prefix])
+    {
+        divergence.common_prefix++;
+    }
+
+    // Open-addressing table of the reference's merge positions, keyed by token bytes
+    int capacity = 8;
+    while (capacity < reference_merges->size * 2)
+    {
+        capacity *= 2;
+    }
+    int *table = basic_alloc(MEMORY_OTHER, capacity * sizeof(int));
+    memset(table, 0xFF, capacity * sizeof(int));
+    const int *offsets = reference->vocab_offsets;
+    for (int j = 0; j < reference_merges->size; j++)
+    {
+        int id = reference_merges->ids[j];
+        int slot = hash_bytes(reference->vocab + offsets[id], offsets[id + 1] - offsets[id]) & (capacity - 1);
+        while (table[slot] >= 0)
+        {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        table[slot] = j;
+    }
+
+    double total_shift = 0;
+    for (int i = 0; i < merges->size; i++)
+    {
+        int id = merges->ids[i];
+        const unsigned char *bytes = tokenizer->vocab + tokenizer->vocab_offsets[id];
+        int length = tokenizer->vocab_offsets[id + 1] - tokenizer->vocab_offsets[id];
+        int slot = hash_bytes(bytes, length) & (capacity - 1);
+        while (table[slot] >= 0)
+        {
+            int j = table[slot];
+            int reference_id = reference_merges->ids[j];
+            if (offsets[reference_id + 1] - offsets[reference_id] == length &&
+                memcmp(reference->vocab + offsets[reference_id], bytes, length) == 0)
+            {
+                divergence.shared_tokens++;
+                total_shift += i > j ? i - j : j - i;
+                break;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+    }
+    divergence.compared_tokens = merges->size;
+    divergence.mean_rank_shift = divergence.shared_tokens > 0 ? total_shift / divergence.shared_tokens : 0.0;
+    basic_free(table);
+    return divergence;
+}
+
+/**
+ * Measuring core shared by decoded_length and compiled_decode_into: sums the lengths of
+ * the tokens in `ids` from the vocabulary offsets, or returns -1 on an out-of-range id.
+ */
+ssize_t measure_tokens(const int *offsets, int vocab_size, const int *ids, size_t length)
+{
+    ssize_t total = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (ids[i] < 0 || ids[i] >= vocab_size)
+        {
+            fprintf(stderr, "Error: ID %d out of range (0-%d).\n", ids[i], vocab_size - 1);
+            return -1;
+        }
+        total += offsets[ids[i] + 1] - offsets[ids[i]];
+    }
+    return total;
+}
+
+/**
+ * Decoding core shared by decode_into and compiled_decode_into: validates the ids, checks
+ * the exact output size against `capacity`, then copies each token with one memcpy.
+ *
+ * @return The number of bytes written to `out`, or -1 on an out-of-range ID or
+ *         insufficient capacity.
+ */
+ssize_t decode_tokens(const unsigned char *vocab, const int *offsets, int vocab_size, const int *ids, size_t length,
+                      unsigned char *out, size_t capacity)
+{
+    ssize_t total = measure_tokens(offsets, vocab_size, ids, length);
+    if (total < 0)
+    {
+        return -1;
+    }
+    if ((size_t)total > capacity)
+    {
+        fprintf(stderr, "Error: output buffer too small (%zd bytes needed, %zu available).\n", total, capacity);
+        return -1;
+    }
+
+    size_t pos = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        int start = offsets[ids[i]];
+        int token_length = offsets[ids[i] + 1] - start;
+        memcpy(out + pos, vocab + start, token_length);
+        pos += token_length;
+    }
+    return pos;
+}
+
+/**
+ * Computes the exact number of bytes that decoding `ids` produces. Token lengths are
+ * precomputed in the vocabulary offsets, so this is a single pass of subtractions with
+ * no string scanning, and its result can be used to size an output buffer exactly
+ * before calling decode_into.
+ *
+ * @param tokenizer A pointer to the BasicTokenizer whose vocabulary defines the tokens.
+ * @param ids Pointer to an integer array containing the token IDs to be measured.
+ * @param length The number of elements in the `ids` array.
+ * @return The number of bytes the decoded text occupies, or -1 if any ID is out of range.
+ *
+ * Example usage:
+ * ssize_t size = decoded_length(tokenizer, ids, length);
+ * unsigned char *text = malloc(size + 1);
+ */
+ssize_t decoded_length(BasicTokenizer *tokenizer, int *ids, size_t length)
+{
+    return measure_tokens(tokenizer->vocab_offsets, tokenizer->vocab_size, ids, length);
+}
+
+/**
+ * Decodes an array of integer IDs into a caller-provided buffer. The exact output size is
+ * computed up front from the precomputed token lengths, and each token is then copied
+ * into place with a single memcpy, so decoding never goes through stdio and never
+ * reallocates.
+ *
+ * The output is raw bytes and is not NUL-terminated; callers that want a C string should
+ * reserve one extra byte and terminate it using the returned length. Nothing is written
+ * if the buffer is too small or an ID is out of range.
+ *
+ * @param tokenizer A pointer to the BasicTokenizer structure which contains the vocabulary
+ *                  used for decoding the integer IDs.
+ * @param ids Pointer to an integer array containing the token IDs to be decoded.
+ * @param length The number of elements in the `ids` array.
+ * @param out Buffer receiving the decoded bytes.
+ * @param capacity The size of `out` in bytes.
+ * @return The number of bytes written to `out`, or -1 on invalid input, an out-of-range ID,
+ *         or insufficient capacity.
+ *
+ * Example usage:
+ * unsigned char buffer[256];
+ * ssize_t n = decode_into(tokenizer, ids, length, buffer, sizeof(buffer) - 1);
+ * if (n >= 0)
+ *     buffer[n] = '\0';
+ */
+ssize_t decode_into(BasicTokenizer *tokenizer, int *ids, size_t length, unsigned char *out, size_t capacity)
+{
+    if (tokenizer == NULL || ids == NULL || out == NULL)
+    {
+        fprintf(stderr, "Invalid input: tokenizer, ids and out must not be NULL.\n");
+        return -1;
+    }
+    return decode_tokens(tokenizer->vocab, tokenizer->vocab_offsets, tokenizer->vocab_size, ids, length, out,
+                         capacity);
+}
+
+/**
+ * Decodes an array of integer IDs back into text and writes it to stdout. This is a thin
+ * convenience wrapper over decode_into: the whole text is materialized in one buffer and
+ * emitted with a single fwrite, so it is suitable for printing results in tools and demos.
+ * Library callers should use decode_into directly.
+ *
+ * @param tokenizer A pointer to the BasicTokenizer structure which contains the vocabulary
+ *                  used for decoding the integer IDs.
+ * @param ids Pointer to an integer array containing the token IDs to be decoded.
+ * @param length The number of elements in the `ids` array, indicating how many tokens to decode.
+ *
+ * Example usage:
+ * BasicTokenizer* tokenizer = create_basic_tokenizer();  // Assumes tokenizer is already trained
+ * int ids[] = {72, 101, 108, 108, 111};  // Example token IDs for 'Hello'
+ * int length = sizeof(ids) / sizeof(ids[0]);
+ * decode(tokenizer, ids, length);  // Output will be 'Hello'
+ */
+void decode(BasicTokenizer *tokenizer, int *ids, size_t length)
+{
+    if (tokenizer == NULL || ids == NULL)
+    {
+        fprintf(stderr, "Invalid input: tokenizer and ids must not be NULL.\n");
+        return;
+    }
+    ssize_t size = decoded_length(tokenizer, ids, length);
+    if (size < 0)
+    {
+        return;
+    }
+    unsigned char *text = basic_alloc(MEMORY_OTHER, size);
+    ssize_t written = decode_into(tokenizer, ids, length, text, size);
+    if (written > 0)
+    {
+        fwrite(text, 1, written, stdout);
+    }
+    basic_free(text);
+}
+
+/**
+ * Worker for the sizing phase of decode_batch: stores the decoded length of each
+ * sequence in [begin, end) into offsets[s + 1].
+ */
+void *decode_batch_measure(void *arg)
+{
+    DecodeBatchTask *task = arg;
+    for (int s = task->begin; s < task->end; s++)
+    {
+        ssize_t size = decoded_length(task->tokenizer, task->ids[s], task->lengths[s]);
+        if (size < 0)
+        {
+            task->failed = 1;
+            size = 0;
+        }
+        task->offsets[s + 1] = size;
+    }
+    return NULL;
+}
+
+/**
+ * Worker for the fill phase of decode_batch: copies the tokens of each sequence in
+ * [begin, end) to its precomputed offset. Workers write disjoint ranges of the output,
+ * so no synchronization is needed.
+ */
+void *decode_batch_fill(void *arg)
+{
+    DecodeBatchTask *task = arg;
+    unsigned char *vocab = task->tokenizer->vocab;
+    int *vocab_offsets = task->tokenizer->vocab_offsets;
+    for (int s = task->begin; s < task->end; s++)
+    {
+        unsigned char *dst = task->out + task->offsets[s];
+        for (size_t i = 0; i < task->lengths[s]; i++)
+        {
+            int id = task->ids[s][i];
+            int token_length = vocab_offsets[id + 1] - vocab_offsets[id];
+            memcpy(dst, vocab + vocab_offsets[id], token_length);
+            dst += token_length;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Runs `worker` over `num_sequences` sequences split into `num_threads` contiguous
+ * ranges. When `offsets` is non-NULL the ranges are balanced by output bytes rather
+ * than by sequence count, so one long sequence does not leave the other threads idle.
+ * Returns non-zero if any worker reported a failure.
+ */
+int run_decode_batch(DecodeBatchTask *base, int num_sequences, int num_threads, size_t *offsets,
+                     void *(*worker)(void *))
+{
+    DecodeBatchTask *tasks = basic_alloc(MEMORY_OTHER, num_threads * sizeof(DecodeBatchTask));
+    pthread_t *threads = basic_alloc(MEMORY_OTHER, num_threads * sizeof(pthread_t));
+    int begin = 0;
+    for (int t = 0; t < num_threads; t++)
+    {
+        int end = num_sequences * (long long)(t + 1) / num_threads;
+        if (offsets != NULL)
+        {
+            // Advance to the first sequence starting at or after this thread's byte target
+            size_t target = offsets[num_sequences] * (t + 1) / num_threads;
+            end = begin;
+            while (end < num_sequences && offsets[end] < target)
+            {
+                end++;
+            }
+            if (t == num_threads - 1)
+            {
+                end = num_sequences;
+            }
+        }
+        tasks[t] = *base;
+        tasks[t].begin = begin;
+        tasks[t].end = end;
+        tasks[t].failed = 0;
+        begin = end;
+    }
+
+    // The calling thread handles the first range itself, and the ranges of any threads
+    // that could not be started
+    int started = 1;
+    while (started < num_threads && pthread_create(&threads[started], NULL, worker, &tasks[started]) == 0)
+    {
+        started++;
+    }
+    worker(&tasks[0]);
+    for (int t = started; t < num_threads; t++)
+    {
+        worker(&tasks[t]);
+    }
+    int failed = 0;
+    for (int t = 0; t < num_threads; t++)
+    {
+        if (t > 0 && t < started)
+        {
+            pthread_join(threads[t], NULL);
+        }
+        failed |= tasks[t].failed;
+    }
+
+    basic_free(threads);
+    basic_free(tasks);
+    return failed;
+}
+
+/**
+ * Decodes many sequences at once into a single output buffer using several threads.
+ * Decoding happens in two phases that share the vocabulary tables used by decode_into:
+ * first the exact byte size of every sequence is computed from the precomputed token
+ * lengths, then a prefix sum over those sizes assigns each sequence its own slice of
+ * `out`, and finally the threads copy tokens into their disjoint slices without any
+ * locking.
+ *
+ * After the call, sequence `s` occupies out[out_offsets[s]] .. out[out_offsets[s + 1] - 1].
+ * Passing `out` as NULL only computes `out_offsets` and the total size, which lets the
+ * caller allocate the output buffer exactly before decoding.
+ *
+ * @param tokenizer A pointer to the BasicTokenizer whose vocabulary is used for decoding.
+ * @param ids Array of `num_sequences` pointers to token ID arrays.
+ * @param lengths Array holding the number of IDs in each sequence.
+ * @param num_sequences The number of sequences to decode.
+ * @param out Buffer receiving all decoded bytes back to back, or NULL to only size the batch.
+ * @param capacity The size of `out` in bytes.
+ * @param out_offsets Array of `num_sequences + 1` sizes receiving each sequence's offset.
+ * @param num_threads The number of threads to use, including the calling thread.
+ * @return The total number of decoded bytes, or -1 on invalid input, an out-of-range ID,
+ *         or insufficient capacity.
+ *
+ * Example usage:
+ * size_t *offsets = malloc((num_sequences + 1) * sizeof(size_t));
+ * ssize_t total = decode_batch(tokenizer, ids, lengths, num_sequences, NULL, 0, offsets, 8);
+ * unsigned char *text = malloc(total);
+ * decode_batch(tokenizer, ids, lengths, num_sequences, text, total, offsets, 8);
+ */
+ssize_t decode_batch(BasicTokenizer *tokenizer, int **ids, size_t *lengths, int num_sequences, unsigned char *out,
+                     size_t capacity, size_t *out_offsets, int num_threads)
+{
+    if (tokenizer == NULL || ids == NULL || lengths == NULL || out_offsets == NULL || num_sequences < 0)
+    {
+        fprintf(stderr, "Invalid input: tokenizer, ids, lengths and out_offsets must not be NULL.\n");
+        return -1;
+    }
+    if (num_threads > num_sequences)
+    {
+        num_threads = num_sequences;
+    }
+    if (num_threads < 1)
+    {
+        num_threads = 1;
+    }
+
+    DecodeBatchTask base = {tokenizer, ids, lengths, out_offsets, out, 0, 0, 0};
+    out_offsets[0] = 0;
+    if (run_decode_batch(&base, num_sequences, num_threads, NULL, decode_batch_measure))
+    {
+        return -1;
+    }
+    for (int s = 0; s < num_sequences; s++)
+    {
+        out_offsets[s + 1] += out_offsets[s];
+    }
+
+    size_t total = out_offsets[num_sequences];
+    if (out == NULL)
+    {
+        return total;
+    }
+    if (total > capacity)
+    {
+        fprintf(stderr, "Error: output buffer too small (%zu bytes needed, %zu available).\n", total, capacity);
+        return -1;
+    }
+    run_decode_batch(&base, num_sequences, num_threads, out_offsets, decode_batch_fill);
+    return total;
+}
+
+/**
+ * Returns the total length of the UTF-8 sequence introduced by `lead`, or 0 if `lead`
+ * cannot start a sequence (a continuation byte or an invalid lead byte).
+ */
+int utf8_sequence_length(unsigned char lead)
+{
+    if (lead < 0x80)
+        return 1;
+    if ((lead & 0xE0) == 0xC0)
+        return 2;
+    if ((lead & 0xF0) == 0xE0)
+        return 3;
+    if ((lead & 0xF8) == 0xF0)
+        return 4;
+    return 0;
+}
+
+/**
+ * Returns how many bytes at the end of `bytes` form the beginning of a UTF-8 sequence
+ * that is still missing continuation bytes. Only the last three bytes are examined,
+ * since no incomplete sequence can be longer than that. Malformed input is never held
+ * back: if the trailing bytes cannot become a valid sequence they are reported as
+ * complete so that they are passed through unchanged.
+ */
+int utf8_incomplete_suffix(unsigned char *bytes, size_t length)
+{
+    for (int back = 1; back <= 3 && (size_t)back <= length; back++)
+    {
+        unsigned char byte = bytes[length - back];
+        if ((byte & 0xC0) == 0x80)
+        {
+            continue; // Continuation byte, keep looking for the lead
+        }
+        int expected = utf8_sequence_length(byte);
+        return expected > back ? back : 0;
+    }
+    return 0;
+}
+
+/**
+ * Initializes a StreamDecoder for incremental decoding with the given tokenizer. A
+ * stream decoder turns token IDs into bytes as they are produced, but never emits a
+ * partial UTF-8 sequence: when a token ends in the middle of a code point, the
+ * incomplete bytes are held in a small carry and emitted together with the bytes of
+ * the following token(s).
+ *
+ * @param decoder Pointer to the StreamDecoder to initialize.
+ * @param tokenizer The tokenizer whose vocabulary is used for decoding. It must outlive
+ *                  the decoder.
+ *
+ * Example usage:
+ * StreamDecoder decoder;
+ * init_stream_decoder(&decoder, tokenizer);
+ */
+void init_stream_decoder(StreamDecoder *decoder, BasicTokenizer *tokenizer)
+{
+    decoder->tokenizer = tokenizer;
+    decoder->carry_length = 0;
+}
+
+/**
+ * Decodes the next IDs of a stream into `out`, emitting only complete UTF-8 sequences.
+ * Any bytes held back by the previous call are emitted first, followed by the bytes of
+ * `ids`; if the result ends with an incomplete sequence, those trailing bytes (at most
+ * three) are moved into the decoder's carry instead of being returned.
+ *
+ * Each call costs time proportional to the bytes of the new IDs only, regardless of how
+ * much of the stream was decoded before. A capacity of decoded_length(ids) + 3 bytes is
+ * always sufficient. Nothing is consumed if the call fails.
+ *
+ * @param decoder Pointer to an initialized StreamDecoder.
+ * @param ids Pointer to the token IDs to decode next. May hold a single ID.
+ * @param length The number of elements in the `ids` array.
+ * @param out Buffer receiving the emitted bytes.
+ * @param capacity The size of `out` in bytes.
+ * @return The number of bytes emitted into `out`, or -1 on an out-of-range ID or
+ *         insufficient capacity.
+ *
+ * Example usage:
+ * unsigned char buffer[64];
+ * ssize_t n = stream_decode(&decoder, &next_id, 1, buffer, sizeof(buffer));
+ * fwrite(buffer, 1, n, stdout); // Never splits a code point
+ */
+ssize_t stream_decode(StreamDecoder *decoder, int *ids, size_t length, unsigned char *out, size_t capacity)
+{
+    size_t carry_length = decoder->carry_length;
+    if (capacity < carry_length)
+    {
+        fprintf(stderr, "Error: output buffer too small for pending stream bytes.\n");
+        return -1;
+    }
+    ssize_t written = decode_into(decoder->tokenizer, ids, length, out + carry_length, capacity - carry_length);
+    if (written < 0)
+    {
+        return -1;
+    }
+    memcpy(out, decoder->carry, carry_length);
+
+    size_t total = carry_length + written;
+    size_t pending = utf8_incomplete_suffix(out, total);
+    memcpy(decoder->carry, out + total - pending, pending);
+    decoder->carry_length = pending;
+    return total - pending;
+}
+
+/**
+ * Ends a stream, emitting any bytes still held in the decoder's carry. These bytes form
+ * an incomplete UTF-8 sequence, so they are only produced when the stream really ends
+ * in the middle of a code point. The decoder is reset and can be reused afterwards.
+ *
+ * @param decoder Pointer to an initialized StreamDecoder.
+ * @param out Buffer receiving the remaining bytes; 3 bytes always suffice.
+ * @param capacity The size of `out` in bytes.
+ * @return The number of bytes written to `out`, or -1 if `capacity` is too small.
+ */
+ssize_t stream_decode_flush(StreamDecoder *decoder, unsigned char *out, size_t capacity)
+{
+    size_t pending = decoder->carry_length;
+    if (capacity < pending)
+    {
+        fprintf(stderr, "Error: output buffer too small for pending stream bytes.\n");
+        return -1;
+    }
+    memcpy(out, decoder->carry, pending);
+    decoder->carry_length = 0;
+    return pending;
+}
+
+/**
+ * Encoding core shared by encode and compiled_encode: maps each byte of `text` through
+ * `byte_ids` and applies the merges in `ranks` with apply_merges_linked. Only reads the
+ * tables; the merge scratch belongs to the call and comes from the heap, so any number of
+ * threads may encode with the same tables at once.
+ *
+ * @return Pointer to the token ids, from malloc so that callers release it with free, or
+ *         NULL if it cannot be allocated.
+ */
+int *encode_with_tables(const int *byte_ids, const RankTable *ranks, const unsigned char *text, size_t text_length,
+                        size_t *length)
+{
+    int *ids = malloc((text_length > 0 ? text_length : 1) * sizeof(int));
+    if (ids == NULL)
+    {
+        fprintf(stderr, "Error: cannot allocate %zu token ids.\n", text_length);
+        *length = 0;
+        return NULL;
+    }
+    for (size_t i = 0; i < text_length; i++)
+    {
+        ids[i] = byte_ids[text[i]];
+    }
+
+    *length = apply_merges_linked(ranks, ids, text_length, heap_allocator());
+    return ids;
+}
+
+/**
+ * Encodes exactly `text_length` bytes of `text`, which need not be NUL-terminated and may
+ * contain NUL bytes. encode is the strlen wrapper around it.
+ *
+ * @param tokenizer A pointer to the BasicTokenizer whose merges are applied.
+ * @param text The bytes to encode.
+ * @param text_length The number of bytes in `text`.
+ * @param length Receives the number of ids produced.
+ * @return Pointer to the token ids; release it with free. NULL if it cannot be allocated.
+ */
+int *encode_bytes(BasicTokenizer *tokenizer, const unsigned char *text, size_t text_length, size_t *length)
+{
+    return encode_with_tables(tokenizer->byte_ids, &tokenizer->ranks, text, text_length, length);
+}
+
+/**
+ * Encodes the given text into an array of token IDs using the tokenizer's learned merges.
+ * The text is first split into one token per byte (mapped through the tokenizer's byte
+ * ids), then apply_merges_linked repeatedly merges the lowest-ranked adjacent pair until
+ * no mergeable pair remains.
+ *
+ * @param tokenizer A pointer to the BasicTokenizer whose merges are applied.
+ * @param text Unsigned char array representing the input text to be encoded.
+ * @param length Pointer to an integer where the function will store the length of the output array.
+ * @return Pointer to an integer array containing the token IDs; release it with free.
+ *         NULL if it cannot be allocated.
+ *
+ * Example usage:
+ * BasicTokenizer* tokenizer = create_basic_tokenizer();
+ * unsigned char text[] = "hello";
+ * size_t length;
+ * int* encoded_ids = encode(tokenizer, text, &length);
+ * for (size_t i = 0; i < length; i++) {
+ *     printf("%d ", encoded_ids[i]);
+ * }
+ * printf("\n");
+ * free(encoded_ids);
+ */
+int *encode(BasicTokenizer *tokenizer, unsigned char *text, size_t *length)
+{
+    return encode_bytes(tokenizer, text, strlen((char *)text), length);
+}
+
+/**
+ * Reserves `size` bytes at the next cache-line-aligned position of a compiled tokenizer
+ * layout and advances `*cursor` past them. Returns the offset of the reservation.
+ */
+size_t reserve_compiled_section(size_t *cursor, size_t size)
+{
+    size_t offset = (*cursor + MODEL_ALIGNMENT - 1) & ~(size_t)(MODEL_ALIGNMENT - 1);
+    *cursor = offset + size;
+    return offset;
+}
+
+/**
+ * Compiles a trained tokenizer into an immutable CompiledTokenizer holding only what
+ * encoding and decoding read: the vocabulary, the byte id map, the dense byte-pair ranks
+ * and the perfect hash over the merges (or the open-addressing rank table if the merges
+ * were never frozen). Training state such as the merge list and the arena is left behind.
+ *
+ * Everything lives in one allocation with each table on its own cache line, and nothing in
+ * it is written after this function returns. compiled_encode, compiled_decoded_length and
+ * compiled_decode_into only read it and keep their working state in the caller's buffers
+ * or in fresh allocations, so a single instance can be shared by any number of threads
+ * without locks. The source tokenizer may be modified or destroyed afterwards.
+ *
+ * @param tokenizer Pointer to a trained, loaded, mapped or embedded BasicTokenizer.
+ * @return A new CompiledTokenizer to release with free_compiled_tokenizer, or NULL if the
+ *         tokenizer has merges but no rank table to compile them from.
+ *
+ * Example usage:
+ * CompiledTokenizer *compiled = compile_tokenizer(tokenizer);
+ * cleanup_tokenizer(tokenizer);
+ * // ...any number of threads call compiled_encode(compiled, ...) concurrently...
+ * free_compiled_tokenizer(compiled);
+ */
+CompiledTokenizer *compile_tokenizer(const BasicTokenizer *tokenizer)
+{
+    const RankTable *ranks = &tokenizer->ranks;
+    if (tokenizer->merges.size > 0 && ranks->perfect.slots == NULL && ranks->entries == NULL)
+    {
+        fprintf(stderr, "Error: build the rank table before compiling the tokenizer.\n");
+        return NULL;
+    }
+    int vocab_size = tokenizer->vocab_size;
+    int vocab_bytes = tokenizer->vocab_offsets[vocab_size];
+    int use_perfect = ranks->perfect.slots != NULL;
+
+    size_t cursor = sizeof(CompiledTokenizer);
+    size_t offsets_at = reserve_compiled_section(&cursor, (vocab_size + 1) * sizeof(int));
+    size_t vocab_at = reserve_compiled_section(&cursor, vocab_bytes);
+    size_t byte_pairs_size = ranks->byte_pairs != NULL ? BYTE_PAIR_TABLE_SIZE * sizeof(int) : 0;
+    size_t seeds_size = use_perfect ? ranks->perfect.num_buckets * sizeof(uint32_t) : 0;
+    size_t slots_size = use_perfect ? ranks->perfect.num_slots * sizeof(RankEntry) : 0;
+    size_t entries_size = !use_perfect && ranks->entries != NULL ? ranks->capacity * sizeof(RankEntry) : 0;
+    size_t byte_pairs_at = reserve_compiled_section(&cursor, byte_pairs_size);
+    size_t seeds_at = reserve_compiled_section(&cursor, seeds_size);
+    size_t slots_at = reserve_compiled_section(&cursor, slots_size);
+    size_t entries_at = reserve_compiled_section(&cursor, entries_size);
+
+    unsigned char *base = basic_alloc(MEMORY_OTHER, cursor);
+    CompiledTokenizer *compiled = (CompiledTokenizer *)base;
+    memset(compiled, 0, sizeof(CompiledTokenizer));
+    compiled->size = cursor;
+    compiled->vocab_size = vocab_size;
+    memcpy(compiled->byte_ids, tokenizer->byte_ids, sizeof(compiled->byte_ids));
+
+    memcpy(base + offsets_at, tokenizer->vocab_offsets, (vocab_size + 1) * sizeof(int));
+    memcpy(base + vocab_at, tokenizer->vocab, vocab_bytes);
+    compiled->vocab_offsets = (const int *)(base + offsets_at);
+    compiled->vocab = base + vocab_at;
+    if (ranks->byte_pairs != NULL)
+    {
+        memcpy(base + byte_pairs_at, ranks->byte_pairs, byte_pairs_size);
+        compiled->ranks.byte_pairs = (int *)(base + byte_pairs_at);
+    }
+    if (use_perfect)
+    {
+        memcpy(base + seeds_at, ranks->perfect.seeds, seeds_size);
+        memcpy(base + slots_at, ranks->perfect.slots, slots_size);
+        compiled->ranks.perfect.seeds = (uint32_t *)(base + seeds_at);
+        compiled->ranks.perfect.slots = (RankEntry *)(base + slots_at);
+        compiled->ranks.perfect.num_buckets = ranks->perfect.num_buckets;
+        compiled->ranks.perfect.num_slots = ranks->perfect.num_slots;
+    }
+    else if (ranks->entries != NULL)
+    {
+        memcpy(base + entries_at, ranks->entries, entries_size);
+        compiled->ranks.entries = (RankEntry *)(base + entries_at);
+        compiled->ranks.capacity = ranks->capacity;
+    }
+    return compiled;
+}
+
+/**
+ * Releases a CompiledTokenizer. No thread may still be using it.
+ */
+void free_compiled_tokenizer(CompiledTokenizer *compiled)
+{
+    basic_free(compiled);
+}
+
+/**
+ * Encodes `text_length` bytes of `text` with a compiled tokenizer. Produces the same ids
+ * as encode on the tokenizer it was compiled from; the text does not need to be
+ * NUL-terminated. Safe to call concurrently on a shared instance.
+ *
+ * @param compiled The compiled tokenizer, which is only read.
+ * @param text The bytes to encode.
+ * @param text_length The number of bytes in `text`.
+ * @param length Receives the number of ids produced.
+ * @return Pointer to the token ids; release it with free. NULL if it cannot be allocated.
+ *
+ * Example usage:
+ * size_t length;
+ * int *ids = compiled_encode(compiled, text, text_length, &length);
+ * free(ids);
+ */
+int *compiled_encode(const CompiledTokenizer *compiled, const unsigned char *text, size_t text_length, size_t *length)
+{
+    return encode_with_tables(compiled->byte_ids, &compiled->ranks, text, text_length, length);
+}
+
+/**
+ * Returns the number of bytes decoding `ids` with a compiled tokenizer produces, or -1 if
+ * an id is out of range. Safe to call concurrently on a shared instance.
+ */
+ssize_t compiled_decoded_length(const CompiledTokenizer *compiled, const int *ids, size_t length)
+{
+    return measure_tokens(compiled->vocab_offsets, compiled->vocab_size, ids, length);
+}
+
+/**
+ * Decodes ids into a caller-provided buffer with a compiled tokenizer, exactly like
+ * decode_into. Safe to call concurrently on a shared instance as long as each thread
+ * writes to its own buffer.
+ *
+ * @param compiled The compiled tokenizer, which is only read.
+ * @param ids The token ids to decode.
+ * @param length The number of elements in `ids`.
+ * @param out Buffer receiving the decoded bytes (not NUL-terminated).
+ * @param capacity The size of `out` in bytes.
+ * @return The number of bytes written to `out`, or -1 on an out-of-range ID or
+ *         insufficient capacity.
+ */
+ssize_t compiled_decode_into(const CompiledTokenizer *compiled, const int *ids, size_t length, unsigned char *out,
+                             size_t capacity)
+{
+    return decode_tokens(compiled->vocab, compiled->vocab_offsets, compiled->vocab_size, ids, length, out, capacity);
+}
+
+/**
+ * Parses a non-negative decimal integer at `*cursor`, skipping leading spaces and tabs.
+ * On success the cursor is advanced past the digits and 0 is returned; -1 is returned if
+ * no digits are found or the value does not fit in an int.
+ */
+int parse_int(const char **cursor, const char *end, int *value)
+{
+    const char *p = *cursor;
+    while (p < end && (*p == ' ' || *p == '\t'))
+    {
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9')
+    {
+        return -1;
+    }
+    long long result = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        result = result * 10 + (*p - '0');
+        if (result > 0x7FFFFFFF)
+        {
+            return -1;
+        }
+        p++;
+    }
+    *cursor = p;
+    *value = (int)result;
+    return 0;
+}
+
+/**
+ * Returns the end of the line starting at `p` (the position of its newline, or `end`).
+ */
+const char *find_line_end(const char *p, const char *end)
+{
+    const char *newline = memchr(p, '\n', end - p);
+    return newline != NULL ? newline : end;
+}
+
+/**
+ * Reads an entire file into a newly allocated buffer. Returns NULL if the file cannot be
+ * read; otherwise the caller owns the buffer and `*size` holds its length.
+ */
+char *read_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *data = length >= 0 ? basic_alloc(MEMORY_OTHER, length) : NULL;
+    if (data == NULL || fread(data, 1, length, file) != (size_t)length)
+    {
+        basic_free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *size = length;
+    return data;
+}
+
+/**
+ * Loads a tokenizer from a .model file written by the Python minbpe reference
+ * implementation. The format is a "minbpe v1" version line, the split pattern, the number
+ * of special tokens followed by one "token id" line each, and finally one "idx1 idx2" line
+ * per merge in the order the merges were learned. Merge i produces id 256 + i, and the
+ * vocabulary is rebuilt by concatenating the bytes of each merged pair.
+ *
+ * The file is parsed with a hand-rolled integer parser over a single in-memory copy, which
+ * keeps loading fast even for vocabularies with hundreds of thousands of merges.
+ * BasicTokenizer has no regex pre-splitting or special tokens, so a non-empty pattern or
+ * special token section is reported on stderr and ignored; the merges still load.
+ *
+ * @param path Path of the .model file to load.
+ * @return Pointer to a newly created, trainable BasicTokenizer, or NULL if the file is
+ *         missing or malformed.
+ *
+ * Example usage:
+ * BasicTokenizer *tokenizer = load_minbpe_model("basic.model");
+ */
+BasicTokenizer *load_minbpe_model(const char *path)
+{
+    size_t size;
+    char *data = read_file(path, &size);
+    if (data == NULL)
+    {
+        fprintf(stderr, "Error: cannot read minbpe model %s.\n", path);
+        return NULL;
+    }
+    const char *p = data;
+    const char *end = data + size;
+    const char *line_end = find_line_end(p, end);
+    size_t version_length = strlen(MINBPE_VERSION_LINE);
+    if ((size_t)(line_end - p) != version_length || memcmp(p, MINBPE_VERSION_LINE, version_length) != 0)
+    {
+        fprintf(stderr, "Error: %s is not a minbpe v1 model.\n", path);
+        basic_free(data);
+        return NULL;
+    }
+
+    // Split pattern: BasicTokenizer never splits, so only an empty pattern is exact
+    p = line_end < end ? line_end + 1 : end;
+    line_end = find_line_end(p, end);
+    if (line_end > p)
+    {
+        fprintf(stderr, "Warning: ignoring split pattern in %s; BasicTokenizer does not pre-split text.\n", path);
+    }
+    p = line_end < end ? line_end + 1 : end;
+
+    int num_special;
+    if (parse_int(&p, end, &num_special) != 0)
+    {
+        fprintf(stderr, "Error: malformed special token count in %s.\n", path);
+        basic_free(data);
+        return NULL;
+    }
+    if (num_special > 0)
+    {
+        fprintf(stderr, "Warning: ignoring %d special tokens in %s.\n", num_special, path);
+    }
+    p = find_line_end(p, end);
+    for (int i = 0; i < num_special && p < end; i++)
+    {
+        p = find_line_end(p + 1, end);
+    }
+
+    BasicTokenizer *tokenizer = create_basic_tokenizer();
+    while (p < end)
+    {
+        p++; // Skip the newline ending the previous line
+        if (p == end)
+        {
+            break;
+        }
+        Pair pair;
+        int new_idx = tokenizer->vocab_size;
+        if (parse_int(&p, end, &pair.first) != 0 || parse_int(&p, end, &pair.second) != 0 ||
+            pair.first >= new_idx || pair.second >= new_idx)
+        {
+            fprintf(stderr, "Error: malformed merge %d in %s.\n", new_idx - INITIAL_VOCAB_SIZE + 1, path);
+            cleanup_tokenizer(tokenizer);
+            basic_free(data);
+            return NULL;
+        }
+        append_merge(&tokenizer->merges, pair, new_idx);
+        append_merged_token(tokenizer, pair);
+        p = find_line_end(p, end);
+    }
+    basic_free(data);
+    build_rank_table(tokenizer);
+    freeze_merges(tokenizer);
+    return tokenizer;
+}
+
+/*
+ * The code points of Unicode general category C (control, format, surrogate, private use
+ * and unassigned) as inclusive ranges in ascending order, generated from the Unicode 14.0.0
+ * database that Python's unicodedata uses. minbpe escapes these when it renders tokens.
+ */
+const uint32_t UNICODE_OTHER_RANGES[][2] = {
+    {0x0, 0x1F}, {0x7F, 0x9F}, {0xAD, 0xAD}, {0x378, 0x379}, {0x380, 0x383}, {0x38B, 0x38B}, {0x38D, 0x38D},
+    {0x3A2, 0x3A2}, {0x530, 0x530}, {0x557, 0x558}, {0x58B, 0x58C}, {0x590, 0x590}, {0x5C8, 0x5CF}, {0x5EB, 0x5EE},
+    {0x5F5, 0x605}, {0x61C, 0x61C}, {0x6DD, 0x6DD}, {0x70E, 0x70F}, {0x74B, 0x74C}, {0x7B2, 0x7BF}, {0x7FB, 0x7FC},
+    {0x82E, 0x82F}, {0x83F, 0x83F}, {0x85C, 0x85D}, {0x85F, 0x85F}, {0x86B, 0x86F}, {0x88F, 0x897}, {0x8E2, 0x8E2},
+    {0x984, 0x984}, {0x98D, 0x98E}, {0x991, 0x992}, {0x9A9, 0x9A9}, {0x9B1, 0x9B1}, {0x9B3, 0x9B5}, {0x9BA, 0x9BB},
+    {0x9C5, 0x9C6}, {0x9C9, 0x9CA}, {0x9CF, 0x9D6}, {0x9D8, 0x9DB}, {0x9DE, 0x9DE}, {0x9E4, 0x9E5}, {0x9FF, 0xA00},
+    {0xA04, 0xA04}, {0xA0B, 0xA0E}, {0xA11, 0xA12}, {0xA29, 0xA29}, {0xA31, 0xA31}, {0xA34, 0xA34}, {0xA37, 0xA37},
+    {0xA3A, 0xA3B}, {0xA3D, 0xA3D}, {0xA43, 0xA46}, {0xA49, 0xA4A}, {0xA4E, 0xA50}, {0xA52, 0xA58}, {0xA5D, 0xA5D},
+    {0xA5F, 0xA65}, {0xA77, 0xA80}, {0xA84, 0xA84}, {0xA8E, 0xA8E}, {0xA92, 0xA92}, {0xAA9, 0xAA9}, {0xAB1, 0xAB1},
+    {0xAB4, 0xAB4}, {0xABA, 0xABB}, {0xAC6, 0xAC6}, {0xACA, 0xACA}, {0xACE, 0xACF}, {0xAD1, 0xADF}, {0xAE4, 0xAE5},
+    {0xAF2, 0xAF8}, {0xB00, 0xB00}, {0xB04, 0xB04}, {0xB0D, 0xB0E}, {0xB11, 0xB12}, {0xB29, 0xB29}, {0xB31, 0xB31},
+    {0xB34, 0xB34}, {0xB3A, 0xB3B}, {0xB45, 0xB46}, {0xB49, 0xB4A}, {0xB4E, 0xB54}, {0xB58, 0xB5B}, {0xB5E, 0xB5E},
+    {0xB64, 0xB65}, {0xB78, 0xB81}, {0xB84, 0xB84}, {0xB8B, 0xB8D}, {0xB91, 0xB91}, {0xB96, 0xB98}, {0xB9B, 0xB9B},
+    {0xB9D, 0xB9D}, {0xBA0, 0xBA2}, {0xBA5, 0xBA7}, {0xBAB, 0xBAD}, {0xBBA, 0xBBD}, {0xBC3, 0xBC5}, {0xBC9, 0xBC9},
+    {0xBCE, 0xBCF}, {0xBD1, 0xBD6}, {0xBD8, 0xBE5}, {0xBFB, 0xBFF}, {0xC0D, 0xC0D}, {0xC11, 0xC11}, {0xC29, 0xC29},
+    {0xC3A, 0xC3B}, {0xC45, 0xC45}, {0xC49, 0xC49}, {0xC4E, 0xC54}, {0xC57, 0xC57}, {0xC5B, 0xC5C}, {0xC5E, 0xC5F},
+    {0xC64, 0xC65}, {0xC70, 0xC76}, {0xC8D, 0xC8D}, {0xC91, 0xC91}, {0xCA9, 0xCA9}, {0xCB4, 0xCB4}, {0xCBA, 0xCBB},
+    {0xCC5, 0xCC5}, {0xCC9, 0xCC9}, {0xCCE, 0xCD4}, {0xCD7, 0xCDC}, {0xCDF, 0xCDF}, {0xCE4, 0xCE5}, {0xCF0, 0xCF0},
+    {0xCF3, 0xCFF}, {0xD0D, 0xD0D}, {0xD11, 0xD11}, {0xD45, 0xD45}, {0xD49, 0xD49}, {0xD50, 0xD53}, {0xD64, 0xD65},
+    {0xD80, 0xD80}, {0xD84, 0xD84}, {0xD97, 0xD99}, {0xDB2, 0xDB2}, {0xDBC, 0xDBC}, {0xDBE, 0xDBF}, {0xDC7, 0xDC9},
+    {0xDCB, 0xDCE}, {0xDD5, 0xDD5}, {0xDD7, 0xDD7}, {0xDE0, 0xDE5}, {0xDF0, 0xDF1}, {0xDF5, 0xE00}, {0xE3B, 0xE3E},
+    {0xE5C, 0xE80}, {0xE83, 0xE83}, {0xE85, 0xE85}, {0xE8B, 0xE8B}, {0xEA4, 0xEA4}, {0xEA6, 0xEA6}, {0xEBE, 0xEBF},
+    {0xEC5, 0xEC5}, {0xEC7, 0xEC7}, {0xECE, 0xECF}, {0xEDA, 0xEDB}, {0xEE0, 0xEFF}, {0xF48, 0xF48}, {0xF6D, 0xF70},
+    {0xF98, 0xF98}, {0xFBD, 0xFBD}, {0xFCD, 0xFCD}, {0xFDB, 0xFFF}, {0x10C6, 0x10C6}, {0x10C8, 0x10CC},
+    {0x10CE, 0x10CF}, {0x1249, 0x1249}, {0x124E, 0x124F}, {0x1257, 0x1257}, {0x1259, 0x1259}, {0x125E, 0x125F},
+    {0x1289, 0x1289}, {0x128E, 0x128F}, {0x12B1, 0x12B1}, {0x12B6, 0x12B7}, {0x12BF, 0x12BF}, {0x12C1, 0x12C1},
+    {0x12C6, 0x12C7}, {0x12D7, 0x12D7}, {0x1311, 0x1311}, {0x1316, 0x1317}, {0x135B, 0x135C}, {0x137D, 0x137F},
+    {0x139A, 0x139F}, {0x13F6, 0x13F7}, {0x13FE, 0x13FF}, {0x169D, 0x169F}, {0x16F9, 0x16FF}, {0x1716, 0x171E},
+    {0x1737, 0x173F}, {0x1754, 0x175F}, {0x176D, 0x176D}, {0x1771, 0x1771}, {0x1774, 0x177F}, {0x17DE, 0x17DF},
+    {0x17EA, 0x17EF}, {0x17FA, 0x17FF}, {0x180E, 0x180E}, {0x181A, 0x181F}, {0x1879, 0x187F}, {0x18AB, 0x18AF},
+    {0x18F6, 0x18FF}, {0x191F, 0x191F}, {0x192C, 0x192F}, {0x193C, 0x193F}, {0x1941, 0x1943}, {0x196E, 0x196F},
+    {0x1975, 0x197F}, {0x19AC, 0x19AF}, {0x19CA, 0x19CF}, {0x19DB, 0x19DD}, {0x1A1C, 0x1A1D}, {0x1A5F, 0x1A5F},
+    {0x1A7D, 0x1A7E}, {0x1A8A, 0x1A8F}, {0x1A9A, 0x1A9F}, {0x1AAE, 0x1AAF}, {0x1ACF, 0x1AFF}, {0x1B4D, 0x1B4F},
+    {0x1B7F, 0x1B7F}, {0x1BF4, 0x1BFB}, {0x1C38, 0x1C3A}, {0x1C4A, 0x1C4C}, {0x1C89, 0x1C8F}, {0x1CBB, 0x1CBC},
+    {0x1CC8, 0x1CCF}, {0x1CFB, 0x1CFF}, {0x1F16, 0x1F17}, {0x1F1E, 0x1F1F}, {0x1F46, 0x1F47}, {0x1F4E, 0x1F4F},
+    {0x1F58, 0x1F58}, {0x1F5A, 0x1F5A}, {0x1F5C, 0x1F5C}, {0x1F5E, 0x1F5E}, {0x1F7E, 0x1F7F}, {0x1FB5, 0x1FB5},
+    {0x1FC5, 0x1FC5}, {0x1FD4, 0x1FD5}, {0x1FDC, 0x1FDC}, {0x1FF0, 0x1FF1}, {0x1FF5, 0x1FF5}, {0x1FFF, 0x1FFF},
+    {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x206F}, {0x2072, 0x2073}, {0x208F, 0x208F}, {0x209D, 0x209F},
+    {0x20C1, 0x20CF}, {0x20F1, 0x20FF}, {0x218C, 0x218F}, {0x2427, 0x243F}, {0x244B, 0x245F}, {0x2B74, 0x2B75},
+    {0x2B96, 0x2B96}, {0x2CF4, 0x2CF8}, {0x2D26, 0x2D26}, {0x2D28, 0x2D2C}, {0x2D2E, 0x2D2F}, {0x2D68, 0x2D6E},
+    {0x2D71, 0x2D7E}, {0x2D97, 0x2D9F}, {0x2DA7, 0x2DA7}, {0x2DAF, 0x2DAF}, {0x2DB7, 0x2DB7}, {0x2DBF, 0x2DBF},
+    {0x2DC7, 0x2DC7}, {0x2DCF, 0x2DCF}, {0x2DD7, 0x2DD7}, {0x2DDF, 0x2DDF}, {0x2E5E, 0x2E7F}, {0x2E9A, 0x2E9A},
+    {0x2EF4, 0x2EFF}, {0x2FD6, 0x2FEF}, {0x2FFC, 0x2FFF}, {0x3040, 0x3040}, {0x3097, 0x3098}, {0x3100, 0x3104},
+    {0x3130, 0x3130}, {0x318F, 0x318F}, {0x31E4, 0x31EF}, {0x321F, 0x321F}, {0xA48D, 0xA48F}, {0xA4C7, 0xA4CF},
+    {0xA62C, 0xA63F}, {0xA6F8, 0xA6FF}, {0xA7CB, 0xA7CF}, {0xA7D2, 0xA7D2}, {0xA7D4, 0xA7D4}, {0xA7DA, 0xA7F1},
+    {0xA82D, 0xA82F}, {0xA83A, 0xA83F}, {0xA878, 0xA87F}, {0xA8C6, 0xA8CD}, {0xA8DA, 0xA8DF}, {0xA954, 0xA95E},
+    {0xA97D, 0xA97F}, {0xA9CE, 0xA9CE}, {0xA9DA, 0xA9DD}, {0xA9FF, 0xA9FF}, {0xAA37, 0xAA3F}, {0xAA4E, 0xAA4F},
+    {0xAA5A, 0xAA5B}, {0xAAC3, 0xAADA}, {0xAAF7, 0xAB00}, {0xAB07, 0xAB08}, {0xAB0F, 0xAB10}, {0xAB17, 0xAB1F},
+    {0xAB27, 0xAB27}, {0xAB2F, 0xAB2F}, {0xAB6C, 0xAB6F}, {0xABEE, 0xABEF}, {0xABFA, 0xABFF}, {0xD7A4, 0xD7AF},
+    {0xD7C7, 0xD7CA}, {0xD7FC, 0xF8FF}, {0xFA6E, 0xFA6F}, {0xFADA, 0xFAFF}, {0xFB07, 0xFB12}, {0xFB18, 0xFB1C},
+    {0xFB37, 0xFB37}, {0xFB3D, 0xFB3D}, {0xFB3F, 0xFB3F}, {0xFB42, 0xFB42}, {0xFB45, 0xFB45}, {0xFBC3, 0xFBD2},
+    {0xFD90, 0xFD91}, {0xFDC8, 0xFDCE}, {0xFDD0, 0xFDEF}, {0xFE1A, 0xFE1F}, {0xFE53, 0xFE53}, {0xFE67, 0xFE67},
+    {0xFE6C, 0xFE6F}, {0xFE75, 0xFE75}, {0xFEFD, 0xFF00}, {0xFFBF, 0xFFC1}, {0xFFC8, 0xFFC9}, {0xFFD0, 0xFFD1},
+    {0xFFD8, 0xFFD9}, {0xFFDD, 0xFFDF}, {0xFFE7, 0xFFE7}, {0xFFEF, 0xFFFB}, {0xFFFE, 0xFFFF}, {0x1000C, 0x1000C},
+    {0x10027, 0x10027}, {0x1003B, 0x1003B}, {0x1003E, 0x1003E}, {0x1004E, 0x1004F}, {0x1005E, 0x1007F},
+    {0x100FB, 0x100FF}, {0x10103, 0x10106}, {0x10134, 0x10136}, {0x1018F, 0x1018F}, {0x1019D, 0x1019F},
+    {0x101A1, 0x101CF}, {0x101FE, 0x1027F}, {0x1029D, 0x1029F}, {0x102D1, 0x102DF}, {0x102FC, 0x102FF},
+    {0x10324, 0x1032C}, {0x1034B, 0x1034F}, {0x1037B, 0x1037F}, {0x1039E, 0x1039E}, {0x103C4, 0x103C7},
+    {0x103D6, 0x103FF}, {0x1049E, 0x1049F}, {0x104AA, 0x104AF}, {0x104D4, 0x104D7}, {0x104FC, 0x104FF},
+    {0x10528, 0x1052F}, {0x10564, 0x1056E}, {0x1057B, 0x1057B}, {0x1058B, 0x1058B}, {0x10593, 0x10593},
+    {0x10596, 0x10596}, {0x105A2, 0x105A2}, {0x105B2, 0x105B2}, {0x105BA, 0x105BA}, {0x105BD, 0x105FF},
+    {0x10737, 0x1073F}, {0x10756, 0x1075F}, {0x10768, 0x1077F}, {0x10786, 0x10786}, {0x107B1, 0x107B1},
+    {0x107BB, 0x107FF}, {0x10806, 0x10807}, {0x10809, 0x10809}, {0x10836, 0x10836}, {0x10839, 0x1083B},
+    {0x1083D, 0x1083E}, {0x10856, 0x10856}, {0x1089F, 0x108A6}, {0x108B0, 0x108DF}, {0x108F3, 0x108F3},
+    {0x108F6, 0x108FA}, {0x1091C, 0x1091E}, {0x1093A, 0x1093E}, {0x10940, 0x1097F}, {0x109B8, 0x109BB},
+    {0x109D0, 0x109D1}, {0x10A04, 0x10A04}, {0x10A07, 0x10A0B}, {0x10A14, 0x10A14}, {0x10A18, 0x10A18},
+    {0x10A36, 0x10A37}, {0x10A3B, 0x10A3E}, {0x10A49, 0x10A4F}, {0x10A59, 0x10A5F}, {0x10AA0, 0x10ABF},
+    {0x10AE7, 0x10AEA}, {0x10AF7, 0x10AFF}, {0x10B36, 0x10B38}, {0x10B56, 0x10B57}, {0x10B73, 0x10B77},
+    {0x10B92, 0x10B98}, {0x10B9D, 0x10BA8}, {0x10BB0, 0x10BFF}, {0x10C49, 0x10C7F}, {0x10CB3, 0x10CBF},
+    {0x10CF3, 0x10CF9}, {0x10D28, 0x10D2F}, {0x10D3A, 0x10E5F}, {0x10E7F, 0x10E7F}, {0x10EAA, 0x10EAA},
+    {0x10EAE, 0x10EAF}, {0x10EB2, 0x10EFF}, {0x10F28, 0x10F2F}, {0x10F5A, 0x10F6F}, {0x10F8A, 0x10FAF},
+    {0x10FCC, 0x10FDF}, {0x10FF7, 0x10FFF}, {0x1104E, 0x11051}, {0x11076, 0x1107E}, {0x110BD, 0x110BD},
+    {0x110C3, 0x110CF}, {0x110E9, 0x110EF}, {0x110FA, 0x110FF}, {0x11135, 0x11135}, {0x11148, 0x1114F},
+    {0x11177, 0x1117F}, {0x111E0, 0x111E0}, {0x111F5, 0x111FF}, {0x11212, 0x11212}, {0x1123F, 0x1127F},
+    {0x11287, 0x11287}, {0x11289, 0x11289}, {0x1128E, 0x1128E}, {0x1129E, 0x1129E}, {0x112AA, 0x112AF},
+    {0x112EB, 0x112EF}, {0x112FA, 0x112FF}, {0x11304, 0x11304}, {0x1130D, 0x1130E}, {0x11311, 0x11312},
+    {0x11329, 0x11329}, {0x11331, 0x11331}, {0x11334, 0x11334}, {0x1133A, 0x1133A}, {0x11345, 0x11346},
+    {0x11349, 0x1134A}, {0x1134E, 0x1134F}, {0x11351, 0x11356}, {0x11358, 0x1135C}, {0x11364, 0x11365},
+    {0x1136D, 0x1136F}, {0x11375, 0x113FF}, {0x1145C, 0x1145C}, {0x11462, 0x1147F}, {0x114C8, 0x114CF},
+    {0x114DA, 0x1157F}, {0x115B6, 0x115B7}, {0x115DE, 0x115FF}, {0x11645, 0x1164F}, {0x1165A, 0x1165F},
+    {0x1166D, 0x1167F}, {0x116BA, 0x116BF}, {0x116CA, 0x116FF}, {0x1171B, 0x1171C}, {0x1172C, 0x1172F},
+    {0x11747, 0x117FF}, {0x1183C, 0x1189F}, {0x118F3, 0x118FE}, {0x11907, 0x11908}, {0x1190A, 0x1190B},
+    {0x11914, 0x11914}, {0x11917, 0x11917}, {0x11936, 0x11936}, {0x11939, 0x1193A}, {0x11947, 0x1194F},
+    {0x1195A, 0x1199F}, {0x119A8, 0x119A9}, {0x119D8, 0x119D9}, {0x119E5, 0x119FF}, {0x11A48, 0x11A4F},
+    {0x11AA3, 0x11AAF}, {0x11AF9, 0x11BFF}, {0x11C09, 0x11C09}, {0x11C37, 0x11C37}, {0x11C46, 0x11C4F},
+    {0x11C6D, 0x11C6F}, {0x11C90, 0x11C91}, {0x11CA8, 0x11CA8}, {0x11CB7, 0x11CFF}, {0x11D07, 0x11D07},
+    {0x11D0A, 0x11D0A}, {0x11D37, 0x11D39}, {0x11D3B, 0x11D3B}, {0x11D3E, 0x11D3E}, {0x11D48, 0x11D4F},
+    {0x11D5A, 0x11D5F}, {0x11D66, 0x11D66}, {0x11D69, 0x11D69}, {0x11D8F, 0x11D8F}, {0x11D92, 0x11D92},
+    {0x11D99, 0x11D9F}, {0x11DAA, 0x11EDF}, {0x11EF9, 0x11FAF}, {0x11FB1, 0x11FBF}, {0x11FF2, 0x11FFE},
+    {0x1239A, 0x123FF}, {0x1246F, 0x1246F}, {0x12475, 0x1247F}, {0x12544, 0x12F8F}, {0x12FF3, 0x12FFF},
+    {0x1342F, 0x143FF}, {0x14647, 0x167FF}, {0x16A39, 0x16A3F}, {0x16A5F, 0x16A5F}, {0x16A6A, 0x16A6D},
+    {0x16ABF, 0x16ABF}, {0x16ACA, 0x16ACF}, {0x16AEE, 0x16AEF}, {0x16AF6, 0x16AFF}, {0x16B46, 0x16B4F},
+    {0x16B5A, 0x16B5A}, {0x16B62, 0x16B62}, {0x16B78, 0x16B7C}, {0x16B90, 0x16E3F}, {0x16E9B, 0x16EFF},
+    {0x16F4B, 0x16F4E}, {0x16F88, 0x16F8E}, {0x16FA0, 0x16FDF}, {0x16FE5, 0x16FEF}, {0x16FF2, 0x16FFF},
+    {0x187F8, 0x187FF}, {0x18CD6, 0x18CFF}, {0x18D09, 0x1AFEF}, {0x1AFF4, 0x1AFF4}, {0x1AFFC, 0x1AFFC},
+    {0x1AFFF, 0x1AFFF}, {0x1B123, 0x1B14F}, {0x1B153, 0x1B163}, {0x1B168, 0x1B16F}, {0x1B2FC, 0x1BBFF},
+    {0x1BC6B, 0x1BC6F}, {0x1BC7D, 0x1BC7F}, {0x1BC89, 0x1BC8F}, {0x1BC9A, 0x1BC9B}, {0x1BCA0, 0x1CEFF},
+    {0x1CF2E, 0x1CF2F}, {0x1CF47, 0x1CF4F}, {0x1CFC4, 0x1CFFF}, {0x1D0F6, 0x1D0FF}, {0x1D127, 0x1D128},
+    {0x1D173, 0x1D17A}, {0x1D1EB, 0x1D1FF}, {0x1D246, 0x1D2DF}, {0x1D2F4, 0x1D2FF}, {0x1D357, 0x1D35F},
+    {0x1D379, 0x1D3FF}, {0x1D455, 0x1D455}, {0x1D49D, 0x1D49D}, {0x1D4A0, 0x1D4A1}, {0x1D4A3, 0x1D4A4},
+    {0x1D4A7, 0x1D4A8}, {0x1D4AD, 0x1D4AD}, {0x1D4BA, 0x1D4BA}, {0x1D4BC, 0x1D4BC}, {0x1D4C4, 0x1D4C4},
+    {0x1D506, 0x1D506}, {0x1D50B, 0x1D50C}, {0x1D515, 0x1D515}, {0x1D51D, 0x1D51D}, {0x1D53A, 0x1D53A},
+    {0x1D53F, 0x1D53F}, {0x1D545, 0x1D545}, {0x1D547, 0x1D549}, {0x1D551, 0x1D551}, {0x1D6A6, 0x1D6A7},
+    {0x1D7CC, 0x1D7CD}, {0x1DA8C, 0x1DA9A}, {0x1DAA0, 0x1DAA0}, {0x1DAB0, 0x1DEFF}, {0x1DF1F, 0x1DFFF},
+    {0x1E007, 0x1E007}, {0x1E019, 0x1E01A}, {0x1E022, 0x1E022}, {0x1E025, 0x1E025}, {0x1E02B, 0x1E0FF},
+    {0x1E12D, 0x1E12F}, {0x1E13E, 0x1E13F}, {0x1E14A, 0x1E14D}, {0x1E150, 0x1E28F}, {0x1E2AF, 0x1E2BF},
+    {0x1E2FA, 0x1E2FE}, {0x1E300, 0x1E7DF}, {0x1E7E7, 0x1E7E7}, {0x1E7EC, 0x1E7EC}, {0x1E7EF, 0x1E7EF},
+    {0x1E7FF, 0x1E7FF}, {0x1E8C5, 0x1E8C6}, {0x1E8D7, 0x1E8FF}, {0x1E94C, 0x1E94F}, {0x1E95A, 0x1E95D},
+    {0x1E960, 0x1EC70}, {0x1ECB5, 0x1ED00}, {0x1ED3E, 0x1EDFF}, {0x1EE04, 0x1EE04}, {0x1EE20, 0x1EE20},
+    {0x1EE23, 0x1EE23}, {0x1EE25, 0x1EE26}, {0x1EE28, 0x1EE28}, {0x1EE33, 0x1EE33}, {0x1EE38, 0x1EE38},
+    {0x1EE3A, 0x1EE3A}, {0x1EE3C, 0x1EE41}, {0x1EE43, 0x1EE46}, {0x1EE48, 0x1EE48}, {0x1EE4A, 0x1EE4A},
+    {0x1EE4C, 0x1EE4C}, {0x1EE50, 0x1EE50}, {0x1EE53, 0x1EE53}, {0x1EE55, 0x1EE56}, {0x1EE58, 0x1EE58},
+    {0x1EE5A, 0x1EE5A}, {0x1EE5C, 0x1EE5C}, {0x1EE5E, 0x1EE5E}, {0x1EE60, 0x1EE60}, {0x1EE63, 0x1EE63},
+    {0x1EE65, 0x1EE66}, {0x1EE6B, 0x1EE6B}, {0x1EE73, 0x1EE73}, {0x1EE78, 0x1EE78}, {0x1EE7D, 0x1EE7D},
+    {0x1EE7F, 0x1EE7F}, {0x1EE8A, 0x1EE8A}, {0x1EE9C, 0x1EEA0}, {0x1EEA4, 0x1EEA4}, {0x1EEAA, 0x1EEAA},
+    {0x1EEBC, 0x1EEEF}, {0x1EEF2, 0x1EFFF}, {0x1F02C, 0x1F02F}, {0x1F094, 0x1F09F}, {0x1F0AF, 0x1F0B0},
+    {0x1F0C0, 0x1F0C0}, {0x1F0D0, 0x1F0D0}, {0x1F0F6, 0x1F0FF}, {0x1F1AE, 0x1F1E5}, {0x1F203, 0x1F20F},
+    {0x1F23C, 0x1F23F}, {0x1F249, 0x1F24F}, {0x1F252, 0x1F25F}, {0x1F266, 0x1F2FF}, {0x1F6D8, 0x1F6DC},
+    {0x1F6ED, 0x1F6EF}, {0x1F6FD, 0x1F6FF}, {0x1F774, 0x1F77F}, {0x1F7D9, 0x1F7DF}, {0x1F7EC, 0x1F7EF},
+    {0x1F7F1, 0x1F7FF}, {0x1F80C, 0x1F80F}, {0x1F848, 0x1F84F}, {0x1F85A, 0x1F85F}, {0x1F888, 0x1F88F},
+    {0x1F8AE, 0x1F8AF}, {0x1F8B2, 0x1F8FF}, {0x1FA54, 0x1FA5F}, {0x1FA6E, 0x1FA6F}, {0x1FA75, 0x1FA77},
+    {0x1FA7D, 0x1FA7F}, {0x1FA87, 0x1FA8F}, {0x1FAAD, 0x1FAAF}, {0x1FABB, 0x1FABF}, {0x1FAC6, 0x1FACF},
+    {0x1FADA, 0x1FADF}, {0x1FAE8, 0x1FAEF}, {0x1FAF7, 0x1FAFF}, {0x1FB93, 0x1FB93}, {0x1FBCB, 0x1FBEF},
+    {0x1FBFA, 0x1FFFF}, {0x2A6E0, 0x2A6FF}, {0x2B739, 0x2B73F}, {0x2B81E, 0x2B81F}, {0x2CEA2, 0x2CEAF},
+    {0x2EBE1, 0x2F7FF}, {0x2FA1E, 0x2FFFF}, {0x3134B, 0xE00FF}, {0xE01F0, 0x10FFFF},
+};
+
+#define NUM_UNICODE_OTHER_RANGES (sizeof(UNICODE_OTHER_RANGES) / sizeof(UNICODE_OTHER_RANGES[0]))
+
+/**
+ * Returns non-zero if `codepoint` is in Unicode general category C.
+ */
+int is_unicode_other(uint32_t codepoint)
+{
+    size_t low = 0;
+    size_t high = NUM_UNICODE_OTHER_RANGES;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (codepoint > UNICODE_OTHER_RANGES[middle][1])
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low < NUM_UNICODE_OTHER_RANGES && codepoint >= UNICODE_OTHER_RANGES[low][0];
+}
+
+/**
+ * Returns the length of the well-formed UTF-8 sequence at the start of the `length` bytes
+ * at `bytes`, or, if there is none, minus the length of its maximal ill-formed subpart:
+ * the longest prefix that could start a well-formed sequence, or just the first byte.
+ * Decoders that substitute one U+FFFD per maximal subpart, like Python's, consume exactly
+ * that many bytes. Overlong forms, surrogates and code points above U+10FFFF are
+ * ill-formed. On success the code point is stored in `codepoint`.
+ */
+int decode_utf8(const unsigned char *bytes, int length, uint32_t *codepoint)
+{
+    unsigned char lead = bytes[0];
+    int expected = utf8_sequence_length(lead);
+    if (expected == 1)
+    {
+        *codepoint = lead;
+        return 1;
+    }
+    if (expected == 0 || lead < 0xC2 || lead > 0xF4)
+    {
+        return -1;
+    }
+    // The second byte's range excludes overlong forms, surrogates and values above U+10FFFF
+    unsigned char low = lead == 0xE0 ? 0xA0 : lead == 0xF0 ? 0x90 : 0x80;
+    unsigned char high = lead == 0xED ? 0x9F : lead == 0xF4 ? 0x8F : 0xBF;
+    uint32_t value = lead & (0x7F >> expected);
+    for (int k = 1; k < expected; k++)
+    {
+        if (k >= length || bytes[k] < (k == 1 ? low : 0x80) || bytes[k] > (k == 1 ? high : 0xBF))
+        {
+            return -k;
+        }
+        value = value << 6 | (bytes[k] & 0x3F);
+    }
+    *codepoint = value;
+    return expected;
+}
+
+/**
+ * Writes a token's bytes the way minbpe renders them in .vocab files: valid UTF-8 is
+ * copied as is, except that code points of category C (see is_unicode_other) are escaped
+ * as \\uXXXX, and each maximal ill-formed subpart (see decode_utf8) becomes one U+FFFD.
  */
-PairCounts get_stats(int *ids, int length)
+void write_rendered_token(FILE *file, const unsigned char *bytes, int length)
 {
-    PairCounts counts;
-    init_pair_counts(&counts);
-    for (int i = 0; i < length - 1; i++)
+    int i = 0;
+    while (i < length)
     {
-        Pair pair = {ids[i], ids[i + 1]};
-        add_pair_count(&counts, pair, 1);
+        uint32_t codepoint;
+        int size = decode_utf8(bytes + i, length - i, &codepoint);
+        if (size < 0)
+        {
+            fputs("\xEF\xBF\xBD", file);
+            i -= size;
+        }
+        else if (is_unicode_other(codepoint))
+        {
+            fprintf(file, "\\u%04x", (unsigned)codepoint);
+            i += size;
+        }
+        else
+        {
+            fwrite(bytes + i, 1, size, file);
+            i += size;
+        }
     }
-    return counts;
 }
 
 /**
- * Merges consecutive pairs in an integer array that match a specified pair, replacing them
- * with a single specified index. This function is typically used in tokenization processes
- * where frequent pairs of tokens (or characters) are merged into a single new token to
- * compress the sequence or to prepare for further processing.
+ * Saves a tokenizer in the Python minbpe format, writing `<file_prefix>.model` (loadable
+ * by both minbpe and load_minbpe_model) and `<file_prefix>.vocab`, a human-readable
+ * listing of every token and the pair it was merged from. The pattern line is empty and
+ * no special tokens are written, as for minbpe's BasicTokenizer.
  *
- * The function allocates a new integer array to store the result of the merge. For each
- * pair of elements in the input array that matches the specified pair, the function inserts
- * the new index (`idx`) into the new array instead of the pair. Elements not part of a matching
- * pair are copied directly to the new array.
- *
- * @param ids Pointer to the original array of integers.
- * @param length The number of elements in the `ids` array.
- * @param pair The pair of integers to search for in the `ids` array. Consecutive elements
- *             matching this pair are replaced in the output array.
- * @param idx The new integer value that replaces each matching pair in the output array.
- * @param new_length Pointer to an integer where the function will store the length of the
- *                   new array.
- * @return Pointer to the new dynamically allocated array containing the merged integers.
+ * @param tokenizer Pointer to the BasicTokenizer to save.
+ * @param file_prefix Path prefix of the two output files.
+ * @return 0 on success, -1 if either file could not be written.
  *
  * Example usage:
- * int ids[] = {1, 2, 3, 1, 2};
- * int length = 5;
- * Pair pair = {1, 2};
- * int new_length;
- * int* merged_ids = merge(ids, length, pair, 99, &new_length);
- * // `merged_ids` will contain: {99, 3, 99}, `new_length` will be set to 3
+ * save_minbpe_model(tokenizer, "basic"); // Writes basic.model and basic.vocab
  */
-int *merge(int *ids, int length, Pair pair, int idx, int *new_length)
+int save_minbpe_model(BasicTokenizer *tokenizer, const char *file_prefix)
 {
-    int *newids = malloc(length * sizeof(int));
-    int j = 0;
-    for (int i = 0; i < length; i++)
+    for (int i = 0; i < 256; i++)
     {
-        if (i < length - 1 && ids[i] == pair.first && ids[i + 1] == pair.second)
+        if (tokenizer->byte_ids[i] != i)
         {
-            newids[j++] = idx;
-            i++; // Skip the next element
+            fprintf(stderr, "Error: minbpe models require byte i to be token i; this tokenizer remaps bytes.\n");
+            return -1;
         }
-        else
+    }
+    size_t prefix_length = strlen(file_prefix);
+    char *path = basic_alloc(MEMORY_OTHER, prefix_length + 7);
+    memcpy(path, file_prefix, prefix_length);
+
+    strcpy(path + prefix_length, ".model");
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: cannot open %s for writing.\n", path);
+        basic_free(path);
+        return -1;
+    }
+    fprintf(file, "%s\n\n0\n", MINBPE_VERSION_LINE);
+    for (int i = 0; i < tokenizer->merges.size; i++)
+    {
+        Pair pair = unpack_pair(tokenizer->merges.keys[i]);
+        fprintf(file, "%d %d\n", pair.first, pair.second);
+    }
+    int failed = fclose(file) != 0;
+
+    strcpy(path + prefix_length, ".vocab");
+    file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: cannot open %s for writing.\n", path);
+        basic_free(path);
+        return -1;
+    }
+    unsigned char *vocab = tokenizer->vocab;
+    int *offsets = tokenizer->vocab_offsets;
+    for (int idx = 0; idx < tokenizer->vocab_size; idx++)
+    {
+        int merge_index = idx - INITIAL_VOCAB_SIZE;
+        if (merge_index >= 0 && merge_index < tokenizer->merges.size)
         {
-            newids[j++] = ids[i];
+            Pair pair = unpack_pair(tokenizer->merges.keys[merge_index]);
+            fputc('[', file);
+            write_rendered_token(file, vocab + offsets[pair.first], offsets[pair.first + 1] - offsets[pair.first]);
+            fputs("][", file);
+            write_rendered_token(file, vocab + offsets[pair.second], offsets[pair.second + 1] - offsets[pair.second]);
+            fputs("] -> ", file);
         }
+        fputc('[', file);
+        write_rendered_token(file, vocab + offsets[idx], offsets[idx + 1] - offsets[idx]);
+        fprintf(file, "] %d\n", idx);
     }
-    *new_length = j;
-    return newids;
+    failed = fclose(file) != 0 || failed;
+    if (failed)
+    {
+        fprintf(stderr, "Error: failed to write minbpe files for %s.\n", file_prefix);
+    }
+    basic_free(path);
+    return failed ? -1 : 0;
 }
 
 /**
- * Creates and initializes a new BasicTokenizer instance. This function allocates memory
- * for a BasicTokenizer structure and initializes its components, specifically the vocabulary
- * and merges structure. The vocabulary is initialized with INITIAL_VOCAB_SIZE tokens where
- * each token is a single character from the ASCII set. This setup is typical for byte-level
- * tokenization where each byte (character) in the input text can be directly mapped to a token.
- *
- * The function also initializes the merges structure, which is used to store merged token pairs
- * and their frequencies as the tokenizer processes text data.
- *
- * @return Pointer to the newly created BasicTokenizer structure.
- *
- * Example usage:
- * BasicTokenizer* tokenizer = create_basic_tokenizer();
- * // `tokenizer` can now be used for tokenization tasks.
+ * Decodes standard base64 from `src` into `dst`, stopping at the first character that is
+ * not part of the base64 alphabet (padding included). Returns the number of bytes written,
+ * or -1 if the input is malformed or would exceed `capacity`.
  */
-BasicTokenizer *create_basic_tokenizer()
+int base64_decode(const char *src, const char *end, unsigned char *dst, int capacity)
 {
-    BasicTokenizer *tokenizer = malloc(sizeof(BasicTokenizer));
-    tokenizer->vocab = malloc(INITIAL_VOCAB_SIZE * sizeof(unsigned char *));
-    for (int i = 0; i < INITIAL_VOCAB_SIZE; i++)
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned int buffer = 0;
+    int bits = 0;
+    int written = 0;
+    const char *p = src;
+    for (; p < end && *p != '=' && *p != ' ' && *p != '\n' && *p != '\r'; p++)
     {
-        tokenizer->vocab[i] = malloc(2);
-        tokenizer->vocab[i][0] = i;
-        tokenizer->vocab[i][1] = '\0';
+        const char *found = memchr(alphabet, *p, 64);
+        if (found == NULL)
+        {
+            return -1;
+        }
+        buffer = (buffer << 6) | (unsigned int)(found - alphabet);
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            if (written == capacity)
+            {
+                return -1;
+            }
+            dst[written++] = (buffer >> bits) & 0xFF;
+        }
     }
-    tokenizer->vocab_size = INITIAL_VOCAB_SIZE;
-    init_pair_counts(&tokenizer->merges);
-    return tokenizer;
+    return written;
 }
 
 /**
- * Trains the BasicTokenizer by processing the given text to identify and merge
- * frequent pairs of characters (or tokens). This function adapts the Byte Pair Encoding
- * algorithm to progressively merge the most frequent adjacent pairs of tokens into
- * single tokens, thereby increasing the tokenizer's vocabulary based on the text input.
+ * Loads a tokenizer from a tiktoken rank file, where each line holds a base64-encoded
+ * token followed by its rank. Ranks must be exactly 0..N-1, and ranks 0..255 must be the
+ * 256 single-byte tokens (in any order, recorded in the tokenizer's byte ids).
  *
- * The function first converts the input text into an array of integers (`ids`), where
- * each integer represents the ASCII value of a character in the text. It then performs
- * a series of merges, each time finding the most frequent pair of tokens and replacing
- * all occurrences of that pair in the text with a new token. Each new token is added
- * to the tokenizer's vocabulary.
+ * tiktoken stores only the tokens, not the merges that produced them, so the merges are
+ * recovered in rank order: each multi-byte token is encoded with the merges recovered so
+ * far (all of lower rank), which for a BPE vocabulary always leaves exactly two parts.
+ * Those two parts are the token's merge pair, and the token's rank is its id. The result
+ * is an ordinary BasicTokenizer whose encode produces the same ids as tiktoken for text
+ * that tiktoken would not pre-split (BasicTokenizer applies no regex split pattern).
  *
- * @param tokenizer Pointer to the BasicTokenizer instance to be trained.
- * @param text Unsigned char array containing the input text to be processed.
- * @param vocab_size The desired size of the vocabulary after training. The number of
- *                   merges performed is determined by the difference between `vocab_size`
- *                   and `INITIAL_VOCAB_SIZE`.
- * @param verbose If non-zero, the function prints detailed logs of each merge operation,
- *                showing progress and statistics such as which pairs were merged and
- *                the number of occurrences.
+ * @param path Path of the tiktoken rank file.
+ * @return Pointer to a newly created BasicTokenizer, or NULL if the file is missing,
+ *         malformed, or not a BPE vocabulary.
  *
  * Example usage:
- * BasicTokenizer* tokenizer = create_basic_tokenizer();
- * unsigned char text[] = "example text for tokenizer training";
- * train(tokenizer, text, 300, 1);  // Trains tokenizer to expand its vocab to 300 tokens
+ * BasicTokenizer *tokenizer = load_tiktoken_ranks("cl100k_base.tiktoken");
  */
-void train(BasicTokenizer *tokenizer, unsigned char *text, int vocab_size, int verbose)
+BasicTokenizer *load_tiktoken_ranks(const char *path)
 {
-    int text_length = strlen((char *)text);
-    int *ids = malloc(text_length * sizeof(int));
-    for (int i = 0; i < text_length; i++)
+    size_t size;
+    char *data = read_file(path, &size);
+    if (data == NULL)
     {
-        ids[i] = text[i];
+        fprintf(stderr, "Error: cannot read tiktoken file %s.\n", path);
+        return NULL;
     }
+    const char *end = data + size;
 
-    int num_merges = vocab_size - INITIAL_VOCAB_SIZE;
-    PairCounts stats;
-    for (int i = 0; i < num_merges; i++)
+    // First pass: count tokens and size the decoded byte arena
+    int num_tokens = 0;
+    size_t encoded_bytes = 0;
+    for (const char *p = data; p < end; p = find_line_end(p, end) + 1)
     {
-        stats = get_stats(ids, text_length);
-        int max_idx = 0;
-        for (int j = 1; j < stats.size; j++)
+        const char *line_end = find_line_end(p, end);
+        if (line_end > p)
         {
-            if (stats.counts[j] > stats.counts[max_idx])
-            {
-                max_idx = j;
-            }
+            num_tokens++;
+            encoded_bytes += line_end - p;
+        }
+    }
+    if (num_tokens < INITIAL_VOCAB_SIZE)
+    {
+        fprintf(stderr, "Error: %s has %d tokens; all 256 single bytes are required.\n", path, num_tokens);
+        basic_free(data);
+        return NULL;
+    }
+
+    // Second pass: decode every token into its slot, indexed by rank
+    unsigned char *bytes = basic_alloc(MEMORY_OTHER, encoded_bytes);
+    int *token_start = basic_alloc(MEMORY_OTHER, num_tokens * sizeof(int));
+    int *token_length = basic_alloc(MEMORY_OTHER, num_tokens * sizeof(int));
+    for (int i = 0; i < num_tokens; i++)
+    {
+        token_length[i] = -1;
+    }
+    int used = 0;
+    int ok = 1;
+    for (const char *p = data; ok && p < end; p = find_line_end(p, end) + 1)
+    {
+        const char *line_end = find_line_end(p, end);
+        if (line_end == p)
+        {
+            continue;
         }
-        Pair max_pair = stats.pairs[max_idx];
-        int new_idx = INITIAL_VOCAB_SIZE + i;
-        int new_length;
-        ids = merge(ids, text_length, max_pair, new_idx, &new_length);
-        text_length = new_length;
-        add_pair_count(&tokenizer->merges, max_pair, new_idx);
-        tokenizer->vocab = realloc(tokenizer->vocab, (tokenizer->vocab_size + 1) * sizeof(unsigned char *));
-        tokenizer->vocab[tokenizer->vocab_size] = malloc(3); // Assuming new tokens are two chars long
-        tokenizer->vocab[tokenizer->vocab_size][0] = max_pair.first;
-        tokenizer->vocab[tokenizer->vocab_size][1] = max_pair.second;
-        tokenizer->vocab[tokenizer->vocab_size][2] = '\0';
-        tokenizer->vocab_size++;
-        if (verbose)
+        const char *space = memchr(p, ' ', line_end - p);
+        int length = space != NULL ? base64_decode(p, space, bytes + used, encoded_bytes - used) : -1;
+        const char *cursor = space;
+        int rank;
+        ok = length > 0 && parse_int(&cursor, line_end, &rank) == 0 && rank < num_tokens && token_length[rank] < 0;
+        if (ok)
         {
-            printf("merge %d/%d: (%d, %d) -> %d had %d occurrences\n", i + 1, num_merges, max_pair.first, max_pair.second, new_idx, stats.counts[max_idx]);
+            token_start[rank] = used;
+            token_length[rank] = length;
+            used += length;
         }
     }
-    free(ids);
+    basic_free(data);
+
+    BasicTokenizer *tokenizer = ok ? create_basic_tokenizer() : NULL;
+    for (int rank = 0; ok && rank < INITIAL_VOCAB_SIZE; rank++)
+    {
+        ok = token_length[rank] == 1;
+        if (ok)
+        {
+            unsigned char byte = bytes[token_start[rank]];
+            tokenizer->vocab[rank] = byte;
+            tokenizer->byte_ids[byte] = rank;
+        }
+    }
+    for (int b = 0; ok && b < 256; b++)
+    {
+        ok = tokenizer->vocab[tokenizer->byte_ids[b]] == b; // Every byte value must occur once
+    }
+
+    int *parts = basic_alloc(MEMORY_IDS, encoded_bytes * sizeof(int));
+    if (ok)
+    {
+        reset_rank_table(&tokenizer->arena, &tokenizer->ranks, num_tokens - INITIAL_VOCAB_SIZE);
+    }
+    for (int rank = INITIAL_VOCAB_SIZE; ok && rank < num_tokens; rank++)
+    {
+        unsigned char *token = bytes + token_start[rank];
+        int length = token_length[rank];
+        for (int i = 0; i < length; i++)
+        {
+            parts[i] = tokenizer->byte_ids[token[i]];
+        }
+        ok = apply_merges(&tokenizer->ranks, parts, length) == 2;
+        if (ok)
+        {
+            Pair pair = {parts[0], parts[1]};
+            append_merge(&tokenizer->merges, pair, rank);
+            append_merged_token(tokenizer, pair);
+            insert_rank(&tokenizer->ranks, pack_pair(pair), rank);
+        }
+    }
+    basic_free(parts);
+    basic_free(bytes);
+    basic_free(token_start);
+    basic_free(token_length);
+
+    if (!ok)
+    {
+        fprintf(stderr, "Error: %s is not a complete BPE rank file with ranks 0..N-1.\n", path);
+        if (tokenizer != NULL)
+        {
+            cleanup_tokenizer(tokenizer);
+        }
+        return NULL;
+    }
+    freeze_merges(tokenizer);
+    return tokenizer;
 }
 
 /**
- * Decodes an array of integer IDs back into text using a BasicTokenizer's vocabulary. This function
- * assumes that each integer in the `ids` array corresponds to an index in the tokenizer's vocabulary,
- * where each index maps to a specific token (or character). The function iterates through the `ids`
- * array, retrieves the corresponding tokens from the tokenizer's vocabulary, and prints them to
- * form the decoded text string.
- *
- * This is typically used after text has been encoded into token IDs and some processing has been done,
- * allowing the original or modified text to be reconstructed from the token IDs.
- *
- * @param tokenizer A pointer to the BasicTokenizer structure which contains the vocabulary
- *                  used for decoding the integer IDs.
- * @param ids Pointer to an integer array containing the token IDs to be decoded.
- * @param length The number of elements in the `ids` array, indicating how many tokens to decode.
- *
- * Example usage:
- * BasicTokenizer* tokenizer = create_basic_tokenizer();  // Assumes tokenizer is already trained
- * int ids[] = {72, 101, 108, 108, 111};  // Example token IDs for 'Hello'
- * int length = sizeof(ids) / sizeof(ids[0]);
- * decode(tokenizer, ids, length);  // Output will be 'Hello'
+ * Loads a tokenizer from any supported file, choosing the format by extension: ".model"
+ * is a minbpe text model, ".tiktoken" a tiktoken rank file, and anything else a binary
+ * model written by save_model.
  */
-void decode(BasicTokenizer *tokenizer, int *ids, int length)
+BasicTokenizer *load_tokenizer_file(const char *path)
 {
-    if (tokenizer == NULL || ids == NULL)
+    size_t length = strlen(path);
+    if (length >= 6 && strcmp(path + length - 6, ".model") == 0)
     {
-        fprintf(stderr, "Invalid input: tokenizer and ids must not be NULL.\n");
-        return;
+        return load_minbpe_model(path);
     }
-    printf("Decoded text: ");
-    for (int i = 0; i < length; i++)
+    if (length >= 9 && strcmp(path + length - 9, ".tiktoken") == 0)
     {
-        // Check if the ID is within the range of the vocabulary size
-        if (ids[i] < 0 || ids[i] >= tokenizer->vocab_size)
-        {
-            fprintf(stderr, "Error: ID %d out of range (0-%d).\n", ids[i], tokenizer->vocab_size - 1);
-            continue;
-        }
-        printf("%s", tokenizer->vocab[ids[i]]);
+        return load_tiktoken_ranks(path);
+    }
+    return load_model(path);
+}
+
+/**
+ * Writes `count` integers as the body of a C array initializer, 16 per line.
+ */
+void write_c_int_array(FILE *file, const int *values, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(file, i % 16 == 0 ? "\n    %d," : " %d,", values[i]);
     }
-    printf("\n");
+    fputc('\n', file);
 }
 
 /**
- * Encodes the given text into an array of integer IDs, where each ID represents the ASCII value
- * of the corresponding character in the text. This simple encoding mechanism converts each character
- * of the text into its ASCII equivalent and stores it in an integer array, essentially transforming
- * the input string into a sequence of integers for further processing or tokenization.
+ * Generates a C source file that embeds a tokenizer as static const data. The file holds
+ * the merges, the rank hash table, dense byte-pair ranks and perfect hash, the vocabulary offsets and
+ * byte arena, and the byte id map as `static const` arrays, plus a constructor `BasicTokenizer *<name>_tokenizer(void)`
+ * that returns a statically initialized BasicTokenizer pointing at them.
  *
- * The function also returns the length of the encoded array, which is equal to the length of the input text.
+ * Compiling the generated file into a program removes the need to ship or load a model
+ * file: the constructor performs no allocation or work at all, and the tables live in
+ * read-only pages shared by every process running the binary. The embedded tokenizer is
+ * read-only; it must not be trained, and cleanup_tokenizer leaves it untouched.
  *
- * @param tokenizer A pointer to the BasicTokenizer structure. While this structure is part of the function's
- *                  signature, it's not utilized in this implementation but could be used in future for more
- *                  complex encoding schemes that involve a tokenizer's vocabulary.
- * @param text Unsigned char array representing the input text to be encoded.
- * @param length Pointer to an integer where the function will store the length of the output array.
- *               This value will be set to the number of characters in the input text.
- * @return Pointer to an integer array containing the ASCII values of the characters in the input text.
+ * The generated file expects the BasicTokenizer types to be declared before it is
+ * included; basic.c includes it itself when built with -DEMBEDDED_MODEL.
+ *
+ * @param tokenizer Pointer to the BasicTokenizer to embed.
+ * @param path Path of the C file to create or overwrite.
+ * @param name Prefix for every generated identifier; must be a valid C identifier.
+ * @return 0 on success, -1 if the file could not be written.
  *
  * Example usage:
- * BasicTokenizer* tokenizer = create_basic_tokenizer();
- * unsigned char text[] = "hello";
- * int length;
- * int* encoded_ids = encode(tokenizer, text, &length);
- * for (int i = 0; i < length; i++) {
- *     printf("%d ", encoded_ids[i]);
- * }
- * printf("\n");
- * free(encoded_ids);
+ * write_c_source(tokenizer, "tokenizer_model.h", "my_tokenizer");
+ * // Later, in a program built with the generated file:
+ * BasicTokenizer *tokenizer = my_tokenizer_tokenizer();
  */
-int *encode(BasicTokenizer *tokenizer, unsigned char *text, int *length)
+int write_c_source(BasicTokenizer *tokenizer, const char *path, const char *name)
 {
-    int text_length = strlen((char *)text);
-    int *ids = malloc(text_length * sizeof(int));
-    for (int i = 0; i < text_length; i++)
+    if (tokenizer->mapping == NULL && !tokenizer->embedded)
+    {
+        if (tokenizer->ranks.entries == NULL)
+        {
+            build_rank_table(tokenizer);
+        }
+        if (tokenizer->ranks.perfect.slots == NULL)
+        {
+            freeze_merges(tokenizer);
+        }
+    }
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
     {
-        ids[i] = text[i];
+        fprintf(stderr, "Error: cannot open %s for writing.\n", path);
+        return -1;
     }
 
-    *length = text_length;
-    return ids;
+    int num_merges = tokenizer->merges.size;
+    int vocab_bytes = tokenizer->vocab_offsets[tokenizer->vocab_size];
+    fprintf(file, "/* Tokenizer tables generated by basic.c (emit-c). Do not edit. */\n\n");
+
+    // Zero-length arrays are not valid C, so every array gets at least one element
+    fprintf(file, "static const PairKey %s_merge_keys[%d] = {", name, num_merges > 0 ? num_merges : 1);
+    for (int i = 0; i < num_merges; i++)
+    {
+        fprintf(file, i % 4 == 0 ? "\n    0x%016llxull," : " 0x%016llxull,", (unsigned long long)tokenizer->merges.keys[i]);
+    }
+    fprintf(file, "\n};\n\nstatic const int32_t %s_merge_ids[%d] = {", name, num_merges > 0 ? num_merges : 1);
+    for (int i = 0; i < num_merges; i++)
+    {
+        fprintf(file, i % 16 == 0 ? "\n    %d," : " %d,", tokenizer->merges.ids[i]);
+    }
+    fputc('\n', file);
+
+    fprintf(file, "};\n\nstatic const RankEntry %s_ranks[%d] = {", name, tokenizer->ranks.capacity);
+    for (int i = 0; i < tokenizer->ranks.capacity; i++)
+    {
+        RankEntry entry = tokenizer->ranks.entries[i];
+        fprintf(file, i % 4 == 0 ? "\n    {0x%016llxull, %d, 0}," : " {0x%016llxull, %d, 0},",
+                (unsigned long long)entry.key, entry.idx);
+    }
+
+    fprintf(file, "\n};\n\nstatic const int %s_vocab_offsets[%d] = {", name, tokenizer->vocab_size + 1);
+    write_c_int_array(file, tokenizer->vocab_offsets, tokenizer->vocab_size + 1);
+
+    fprintf(file, "};\n\nstatic const unsigned char %s_vocab[%d] = {", name, vocab_bytes > 0 ? vocab_bytes : 1);
+    for (int i = 0; i < vocab_bytes; i++)
+    {
+        fprintf(file, i % 16 == 0 ? "\n    %d," : " %d,", tokenizer->vocab[i]);
+    }
+
+    fprintf(file, "\n};\n\nstatic const int %s_byte_ids[256] = {", name);
+    write_c_int_array(file, tokenizer->byte_ids, 256);
+
+    fprintf(file, "};\n\nstatic const int %s_byte_pair_ranks[%d] = {", name, BYTE_PAIR_TABLE_SIZE);
+    write_c_int_array(file, tokenizer->ranks.byte_pairs, BYTE_PAIR_TABLE_SIZE);
+
+    PerfectHash *perfect = &tokenizer->ranks.perfect;
+    if (perfect->slots != NULL)
+    {
+        fprintf(file, "};\n\nstatic const uint32_t %s_perfect_seeds[%d] = {", name, perfect->num_buckets);
+        for (int i = 0; i < perfect->num_buckets; i++)
+        {
+            fprintf(file, i % 16 == 0 ? "\n    %u," : " %u,", perfect->seeds[i]);
+        }
+        fprintf(file, "\n};\n\nstatic const RankEntry %s_perfect_slots[%d] = {", name, perfect->num_slots);
+        for (int i = 0; i < perfect->num_slots; i++)
+        {
+            RankEntry entry = perfect->slots[i];
+            fprintf(file, i % 4 == 0 ? "\n    {0x%016llxull, %d, 0}," : " {0x%016llxull, %d, 0},",
+                    (unsigned long long)entry.key, entry.idx);
+        }
+        fputc('\n', file);
+    }
+
+    // The tables are const; the casts only satisfy BasicTokenizer's field types
+    fprintf(file, "};\n\n");
+    fprintf(file, "static BasicTokenizer %s_tokenizer_data = {\n", name);
+    fprintf(file, "    .vocab = (unsigned char *)%s_vocab,\n", name);
+    fprintf(file, "    .vocab_offsets = (int *)%s_vocab_offsets,\n", name);
+    fprintf(file, "    .vocab_size = %d,\n", tokenizer->vocab_size);
+    fprintf(file, "    .byte_ids = (int *)%s_byte_ids,\n", name);
+    fprintf(file, "    .merges = {(PairKey *)%s_merge_keys, (int32_t *)%s_merge_ids, %d, %d, NULL},\n", name, name, num_merges, num_merges);
+    fprintf(file, "    .ranks = {(RankEntry *)%s_ranks, %d, (int *)%s_byte_pair_ranks,\n", name, tokenizer->ranks.capacity, name);
+    if (perfect->slots != NULL)
+    {
+        fprintf(file, "              {(uint32_t *)%s_perfect_seeds, (RankEntry *)%s_perfect_slots, %d, %d}},\n",
+                name, name, perfect->num_buckets, perfect->num_slots);
+    }
+    else
+    {
+        fprintf(file, "              {NULL, NULL, 0, 0}},\n");
+    }
+    fprintf(file, "    .embedded = 1,\n");
+    fprintf(file, "};\n\n");
+    fprintf(file, "static inline BasicTokenizer *%s_tokenizer(void)\n{\n    return &%s_tokenizer_data;\n}\n", name, name);
+
+    if (fclose(file) != 0)
+    {
+        fprintf(stderr, "Error: failed to write %s.\n", path);
+        return -1;
+    }
+    return 0;
 }
 
 void test_tokenizer(BasicTokenizer *tokenizer, unsigned char **input_texts, int num_texts)
@@ -334,13 +5802,13 @@ void test_tokenizer(BasicTokenizer *tokenizer, unsigned char **input_texts, int
     for (int t = 0; t < num_texts; t++)
     {
         // Encode the input text
-        int encoded_length;
+        size_t encoded_length;
         int *encoded_ids = encode(tokenizer, input_texts[t], &encoded_length);
 
         // Print the encoded IDs
         printf("Input text: \"%s\"\n", input_texts[t]);
         printf("Encoded IDs: ");
-        for (int i = 0; i < encoded_length; i++)
+        for (size_t i = 0; i < encoded_length; i++)
         {
             printf("%d ", encoded_ids[i]);
         }
@@ -356,27 +5824,210 @@ void test_tokenizer(BasicTokenizer *tokenizer, unsigned char **input_texts, int
     }
 }
 
-void cleanup_tokenizer(BasicTokenizer *tokenizer)
+/**
+ * Prints one line of the self-check report for `tokenizer`, trained with status
+ * `status`: whether it learned exactly the merges of `reference` or, with `prefix_only`,
+ * the first of them.
+ *
+ * @return 1 if the check passed, 0 otherwise.
+ */
+int report_merge_check(const char *name, int status, const BasicTokenizer *tokenizer,
+                       const BasicTokenizer *reference, int prefix_only)
+{
+    MergeDivergence divergence = compare_merges(tokenizer, reference);
+    int passed = status == 0 && divergence.common_prefix == tokenizer->merges.size &&
+                 (prefix_only || tokenizer->merges.size == reference->merges.size);
+    printf("%s %s: first %d of %d merges identical\n", passed ? "ok  " : "FAIL", name, divergence.common_prefix,
+           prefix_only ? tokenizer->merges.size : reference->merges.size);
+    return passed;
+}
+
+/**
+ * Trains a fresh tokenizer on the file at `path` with `options`, in memory or out of
+ * core, and checks its merges against `reference` (see report_merge_check). With a
+ * minimum frequency, training may stop early, so only a prefix of the merges must match.
+ *
+ * @return 1 if the check passed, 0 otherwise.
+ */
+int check_training(const char *name, const char *path, int vocab_size, const TrainOptions *options,
+                   int out_of_core, const BasicTokenizer *reference)
+{
+    BasicTokenizer *tokenizer = create_basic_tokenizer();
+    int status = out_of_core ? train_out_of_core(tokenizer, path, vocab_size, options)
+                             : train_file(tokenizer, path, vocab_size, options);
+    int passed = report_merge_check(name, status, tokenizer, reference, options->min_frequency > 1);
+    cleanup_tokenizer(tokenizer);
+    return passed;
+}
+
+/**
+ * Prints one line of the self-check report: whether `ids` equal the `expected` ids.
+ *
+ * @return 1 if the check passed, 0 otherwise.
+ */
+int report_encode_check(const char *name, const int *ids, size_t length, const int *expected, size_t expected_length)
+{
+    int passed = ids != NULL && length == expected_length && memcmp(ids, expected, length * sizeof(int)) == 0;
+    printf("%s %s: %zu ids, %zu from encode\n", passed ? "ok  " : "FAIL", name, ids != NULL ? length : 0,
+           expected_length);
+    return passed;
+}
+
+/**
+ * Checks on the corpus at `path` that every way of training and encoding agrees with the
+ * plain single-process hash engine: the sort and sketch engines, `num_workers` worker
+ * processes, out-of-core training (in one shard, and in several for every engine),
+ * resuming from a checkpoint, extending a trained tokenizer, a minimum frequency (a
+ * prefix of the merges), and encoding with a compiled tokenizer and with a saved and
+ * reloaded model. Each check prints one line. The corpus should be small enough to train
+ * on several times over; a few hundred kilobytes take seconds.
+ *
+ * @param path Path of the corpus file.
+ * @param vocab_size The vocabulary size every run trains to.
+ * @param num_workers Worker processes for the workers check.
+ * @return The number of failed checks, or -1 if the reference could not be trained.
+ *
+ * Example usage:
+ * if (self_check("corpus.txt", 1256, 4) != 0)
+ *     fprintf(stderr, "training paths disagree\n");
+ */
+int self_check(const char *path, int vocab_size, int num_workers)
 {
-    // Free each string in the vocabulary
-    for (int i = 0; i < tokenizer->vocab_size; i++)
+    TrainOptions defaults = default_train_options();
+    BasicTokenizer *reference = create_basic_tokenizer();
+    size_t size;
+    char *text = read_file(path, &size);
+    if (text == NULL || train_file(reference, path, vocab_size, &defaults) != 0)
     {
-        free(tokenizer->vocab[i]);
+        basic_free(text);
+        cleanup_tokenizer(reference);
+        return -1;
     }
+    int failures = 0;
 
-    // Free the vocab array itself
-    free(tokenizer->vocab);
+    // Every engine and worker processes learn exactly the merges of the hash engine
+    TrainOptions options = defaults;
+    options.stats_engine = STATS_ENGINE_SORT;
+    failures += !check_training("sort engine", path, vocab_size, &options, 0, reference);
+    options.stats_engine = STATS_ENGINE_SKETCH;
+    failures += !check_training("sketch engine", path, vocab_size, &options, 0, reference);
+    options = defaults;
+    options.num_workers = num_workers;
+    char name[64];
+    snprintf(name, sizeof(name), "%d worker processes", num_workers);
+    failures += !check_training(name, path, vocab_size, &options, 0, reference);
+    options = defaults;
+    options.min_frequency = size / 2000 > 2 ? size / 2000 : 2; // Enough to stop early on most corpora
+    snprintf(name, sizeof(name), "min_frequency %lld", (long long)options.min_frequency);
+    failures += !check_training(name, path, vocab_size, &options, 0, reference);
 
-    // Free the merges structure
-    free(tokenizer->merges.pairs);
-    free(tokenizer->merges.counts);
+    // A corpus in one shard trains out of core exactly as in memory. Shards are separate
+    // sequences, so several shards are checked engine against engine instead
+    options = defaults;
+    options.shard_bytes = size > 0 ? size : 1;
+    if (size <= MAX_SHARD_BYTES)
+    {
+        failures += !check_training("out of core, one shard", path, vocab_size, &options, 1, reference);
+    }
+    options.shard_bytes = size / 4 + 1;
+    BasicTokenizer *sharded = create_basic_tokenizer();
+    int status = train_out_of_core(sharded, path, vocab_size, &options);
+    options.stats_engine = STATS_ENGINE_SORT;
+    failures += !check_training("out of core, 4 shards, sort engine", path, vocab_size, &options, 1, sharded);
+    options.stats_engine = STATS_ENGINE_SKETCH;
+    failures += !check_training("out of core, 4 shards, sketch engine", path, vocab_size, &options, 1, sharded);
+    failures += status != 0;
+    cleanup_tokenizer(sharded);
 
-    // Finally, free the tokenizer structure
-    free(tokenizer);
+    // Stop halfway with a checkpoint, then both resume from it and extend the half-trained tokenizer
+    char model_path[] = "/tmp/basic-self-check-XXXXXX";
+    int fd = mkstemp(model_path);
+    if (fd >= 0)
+    {
+        close(fd);
+        int half = INITIAL_VOCAB_SIZE + (vocab_size - INITIAL_VOCAB_SIZE) / 2;
+        options = defaults;
+        options.checkpoint_path = model_path;
+        options.checkpoint_interval = half > INITIAL_VOCAB_SIZE ? half - INITIAL_VOCAB_SIZE : 1;
+        BasicTokenizer *partial = create_basic_tokenizer();
+        status = train_file(partial, path, half, &options);
+        options.resume = 1;
+        failures += !check_training("resume from a checkpoint", path, vocab_size, &options, 0, reference);
+        status |= train_file(partial, path, vocab_size, &defaults);
+        failures += !report_merge_check("extend a trained tokenizer", status, partial, reference, 0);
+        cleanup_tokenizer(partial);
+    }
+    else
+    {
+        fprintf(stderr, "Error: cannot create a temporary file for the checkpoint and model checks.\n");
+        failures++;
+    }
+
+    // Compiled and reloaded tokenizers encode exactly like the one they came from
+    size_t expected_length;
+    int *expected = encode_bytes(reference, (unsigned char *)text, size, &expected_length);
+    CompiledTokenizer *compiled = compile_tokenizer(reference);
+    size_t length = 0;
+    int *ids = compiled != NULL ? compiled_encode(compiled, (unsigned char *)text, size, &length) : NULL;
+    failures += !report_encode_check("compiled_encode", ids, length, expected, expected_length);
+    free(ids);
+    free_compiled_tokenizer(compiled);
+    BasicTokenizer *loaded = fd >= 0 && save_model(reference, model_path) == 0 ? load_model(model_path) : NULL;
+    ids = loaded != NULL ? encode_bytes(loaded, (unsigned char *)text, size, &length) : NULL;
+    failures += !report_encode_check("saved and loaded model", ids, length, expected, expected_length);
+    free(ids);
+    if (loaded != NULL)
+    {
+        cleanup_tokenizer(loaded);
+    }
+    if (fd >= 0)
+    {
+        remove(model_path);
+    }
+    free(expected);
+    basic_free(text);
+    cleanup_tokenizer(reference);
+    return failures;
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    // Tool mode: basic emit-c <model> <output.h> <name>
+    if (argc > 1 && strcmp(argv[1], "emit-c") == 0)
+    {
+        if (argc != 5)
+        {
+            fprintf(stderr, "Usage: %s emit-c <model file> <output.h> <name>\n", argv[0]);
+            return 1;
+        }
+        BasicTokenizer *tokenizer = load_tokenizer_file(argv[2]);
+        if (tokenizer == NULL)
+        {
+            return 1;
+        }
+        int status = write_c_source(tokenizer, argv[3], argv[4]);
+        cleanup_tokenizer(tokenizer);
+        return status == 0 ? 0 : 1;
+    }
+
+    // Check mode: basic self-check <text file> <vocab size> [workers]
+    if (argc > 1 && strcmp(argv[1], "self-check") == 0)
+    {
+        int num_workers = argc == 5 ? atoi(argv[4]) : 2;
+        if (argc < 4 || argc > 5 || atoi(argv[3]) <= INITIAL_VOCAB_SIZE + 1 || num_workers < 2)
+        {
+            fprintf(stderr, "Usage: %s self-check <text file> <vocab size above 257> [workers, at least 2]\n",
+                    argv[0]);
+            return 1;
+        }
+        int failures = self_check(argv[2], atoi(argv[3]), num_workers);
+        if (failures > 0)
+        {
+            printf("%d checks failed\n", failures);
+        }
+        return failures == 0 ? 0 : 1;
+    }
+
     // Example text to train the tokenizer
     unsigned char text[] = "hello world of machine learning beautiful you are there";
 